@@ -0,0 +1,189 @@
+/**
+ * @file
+ * @brief The harness shared by the benchmarks in bench/.
+ */
+#define _GNU_SOURCE /* For syscall(), perf_event_open has no wrapper. */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "bench.h"
+
+uint64_t bench_ns( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t ) ts.tv_sec * 1000000000u + ( uint64_t ) ts.tv_nsec;
+}
+
+uint64_t bench_timer_overhead( void )
+{
+    static uint64_t overhead = UINT64_MAX;
+    if ( overhead == UINT64_MAX ) {
+        for ( int i = 0; i < 1000; ++i ) {
+            uint64_t t0 = bench_ns();
+            uint64_t t = bench_ns() - t0;
+            if ( t < overhead ) {
+                overhead = t;
+            }
+        }
+    }
+    return overhead;
+}
+
+long bench_peak_rss_kb( void )
+{
+    struct rusage ru;
+    if ( getrusage( RUSAGE_SELF, &ru ) ) {
+        return -1;
+    }
+    return ru.ru_maxrss;
+}
+
+long bench_rss_bytes( void )
+{
+    FILE *fp = fopen( "/proc/self/statm", "r" );
+    long size, resident;
+    if ( !fp ) {
+        return -1;
+    }
+    int got = fscanf( fp, "%ld %ld", &size, &resident );
+    fclose( fp );
+    return got == 2 ? resident * sysconf( _SC_PAGESIZE ) : -1;
+}
+
+#define HW_COUNTERS 5
+
+#define CACHE_READ_MISS(cache) ( (cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 )
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} hw_events[HW_COUNTERS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS( PERF_COUNT_HW_CACHE_L1D ) },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS( PERF_COUNT_HW_CACHE_LL ) },
+    { PERF_TYPE_HW_CACHE, CACHE_READ_MISS( PERF_COUNT_HW_CACHE_DTLB ) },
+};
+
+static int hw_fds[HW_COUNTERS] = { -1, -1, -1, -1, -1 };
+static bool hw_opened, hw_any;
+static uint64_t hw_start[HW_COUNTERS];
+static long faults_start;
+
+static long faults( void )
+{
+    struct rusage ru;
+    getrusage( RUSAGE_THREAD, &ru );
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+/**
+ * Opens the counters for the calling thread, user space only, which is what an
+ * unprivileged process may count with perf_event_paranoid at 2.
+ */
+static void hw_open( void )
+{
+    hw_opened = true;
+    for ( int i = 0; i < HW_COUNTERS; ++i ) {
+        struct perf_event_attr attr;
+        memset( &attr, 0, sizeof attr );
+        attr.size = sizeof attr;
+        attr.type = hw_events[i].type;
+        attr.config = hw_events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        hw_fds[i] = ( int ) syscall( SYS_perf_event_open, &attr, 0, -1, -1, 0 );
+        hw_any |= hw_fds[i] >= 0;
+    }
+}
+
+static void hw_read( uint64_t *values )
+{
+    for ( int i = 0; i < HW_COUNTERS; ++i ) {
+        if ( hw_fds[i] < 0 || read( hw_fds[i], &values[i], sizeof values[i] ) != sizeof values[i] ) {
+            values[i] = 0;
+        }
+    }
+}
+
+void bench_counters_begin( void )
+{
+    if ( !hw_opened ) {
+        hw_open();
+    }
+    faults_start = faults();
+    hw_read( hw_start );
+}
+
+void bench_counters_end( struct bench_counters *c )
+{
+    uint64_t now[HW_COUNTERS];
+    hw_read( now );
+    long f = faults();
+    uint64_t *fields[HW_COUNTERS] = { &c->cycles, &c->instructions, &c->l1d_misses, &c->llc_misses,
+                                      &c->dtlb_misses };
+    for ( int i = 0; i < HW_COUNTERS; ++i ) {
+        *fields[i] = hw_fds[i] < 0 ? UINT64_MAX : *fields[i] + now[i] - hw_start[i];
+    }
+    c->page_faults += ( uint64_t ) ( f - faults_start );
+    c->perf = hw_any;
+}
+
+const char *bench_counters_csv( char *buf, size_t len, const struct bench_counters *c, double ops )
+{
+    const uint64_t values[] = { c->cycles, c->instructions, c->l1d_misses, c->llc_misses, c->dtlb_misses,
+                                c->page_faults };
+    size_t used = 0;
+    buf[0] = '\0';
+    for ( size_t i = 0; i < sizeof values / sizeof *values && used < len; ++i ) {
+        if ( values[i] == UINT64_MAX ) {
+            used += ( size_t ) snprintf( buf + used, len - used, "," );
+        } else {
+            used += ( size_t ) snprintf( buf + used, len - used, "%.3f,", ( double ) values[i] / ops );
+        }
+    }
+    if ( used < len ) {
+        snprintf( buf + used, len - used, "%s", c->perf ? "perf" : "rusage" );
+    }
+    return buf;
+}
+
+static int by_value( const void *a, const void *b )
+{
+    uint64_t x = *( const uint64_t * ) a, y = *( const uint64_t * ) b;
+    return x < y ? -1 : x > y;
+}
+
+uint64_t bench_percentile( uint64_t *samples, size_t n, double q )
+{
+    if ( !n ) {
+        return 0;
+    }
+    qsort( samples, n, sizeof *samples, by_value );
+    size_t i = ( size_t ) ( q * ( double ) n );
+    return samples[i < n ? i : n - 1];
+}
+
+void bench_csv_header( const char *columns )
+{
+    printf( "bench,%s\n", columns );
+    fflush( stdout );
+}
+
+void bench_csv( const char *fmt, ... )
+{
+    va_list ap;
+    va_start( ap, fmt );
+    vprintf( fmt, ap );
+    va_end( ap );
+    putchar( '\n' );
+    fflush( stdout );
+}
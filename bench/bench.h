@@ -0,0 +1,59 @@
+/**
+ * @file
+ * @brief The harness shared by the benchmarks in bench/: clocks, hardware counters, latency
+ * percentiles, and the CSV rows every benchmark prints its results as, so runs can be
+ * compared by scripts.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Nanoseconds on CLOCK_MONOTONIC. */
+uint64_t bench_ns( void );
+
+/** The cost of a bench_ns() pair, subtracted from the latencies of single calls. */
+uint64_t bench_timer_overhead( void );
+
+/** The peak resident set size of the process in kilobytes, from getrusage(). */
+long bench_peak_rss_kb( void );
+
+/** The resident set size of the process in bytes now, from /proc/self/statm, or -1. */
+long bench_rss_bytes( void );
+
+/**
+ * Counters of the calling thread, from perf_event_open, or when that isn't allowed, like in
+ * restricted containers, just the page faults, from getrusage. A counter the CPU doesn't
+ * have is UINT64_MAX.
+ */
+struct bench_counters {
+    uint64_t cycles, instructions, l1d_misses, llc_misses, dtlb_misses, page_faults;
+    bool perf; /**< Whether the hardware counters are available. */
+};
+
+/** The columns bench_counters_csv() fills in, for bench_csv_header(). */
+#define BENCH_COUNTER_COLUMNS "cycles,instructions,l1d_misses,llc_misses,dtlb_misses,page_faults,counters"
+
+/** Starts counting, the counters are opened on the first call. */
+void bench_counters_begin( void );
+
+/**
+ * Stops counting, and adds what was counted since bench_counters_begin() to c, which must
+ * be zeroed before the first call, so the counts of several stretches can be summed.
+ */
+void bench_counters_end( struct bench_counters *c );
+
+/** Formats the counters divided by ops, an empty field for those not available, into buf. */
+const char *bench_counters_csv( char *buf, size_t len, const struct bench_counters *c, double ops );
+
+/** The value at quantile q (0.0 - 1.0) of n samples, which are sorted in place. */
+uint64_t bench_percentile( uint64_t *samples, size_t n, double q );
+
+/** Prints the CSV header line, the first column is always the name of the benchmark. */
+void bench_csv_header( const char *columns );
+
+/** Prints a CSV row, formatted like printf, and flushes it so partial runs aren't lost. */
+void bench_csv( const char *fmt, ... );
+
+#endif
@@ -0,0 +1,98 @@
+/**
+ * @file
+ * @brief Memory footprint of many small objects: the resident bytes per object, measured from
+ * /proc/self/statm, when N million objects of a size are allocated through arena_alloc
+ * and through malloc, and what the overhead over the size of the object is made of:
+ *  padding  The rounding of the requests up to MAX_ALIGN, or to malloc's bins.
+ *  tail     The ends of chunks too small for the next request.
+ *  header   The chunk headers (_AHS) and malloc's header of every chunk, for the arena, or
+ *           malloc's header of every object, MALLOC_PTR_SIZE.
+ *  current  What is left of the chunk the arena allocates from, 0 for malloc.
+ * Every case runs in a child of its own, and the results are printed as CSV.
+ * Built by `make bench`.
+ * usage: footprint [-n millions of objects] [-c chunk_sz]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "core_arena.h"
+#include "bench.h"
+
+static void run( bool arena, size_t size, size_t n, size_t chunk_sz )
+{
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+        perror( "fork" );
+        exit( 1 );
+    }
+    if ( pid ) {
+        waitpid( pid, NULL, 0 );
+        return;
+    }
+    if ( arena ) {
+        arena_init_arenas( 1 );
+        arena_create( 0, chunk_sz );
+    }
+    double padding = 0, tail = 0, header = 0, current = 0;
+    long before = bench_rss_bytes();
+    for ( size_t i = 0; i < n; ++i ) {
+        char *p = arena ? arena_alloc( 0, size ) : malloc( size );
+        if ( !p ) {
+            fprintf( stderr, "footprint: out of memory\n" );
+            exit( 1 );
+        }
+        p[0] = 1; // arena_alloc has touched it all already.
+        if ( !arena && i == 0 ) {
+#ifdef __GLIBC__
+            padding = ( double ) ( malloc_usable_size( p ) - size );
+#endif
+            header = MALLOC_PTR_SIZE;
+        }
+    }
+    long after = bench_rss_bytes();
+    if ( arena ) {
+        struct arena_stats st;
+        arena_stats( 0, &st );
+        padding = ( double ) st.bytes_padding / n;
+        tail = ( double ) st.bytes_tail / n;
+        size_t chunk_hdr, malloc_hdr;
+        arena_get_chunk_header( &chunk_hdr, &malloc_hdr );
+        header = ( double ) ( st.chunks * ( chunk_hdr + malloc_hdr ) ) / n;
+        // bytes_reserved is what is usable of the chunks, so malloc's headers aren't in it.
+        current = ( double ) ( st.bytes_reserved - st.chunks * chunk_hdr - st.bytes_allocated
+                            - st.bytes_padding - st.bytes_tail ) / n;
+    }
+    double rss = ( double ) ( after - before ) / n;
+    bench_csv( "footprint,%s,%zu,%zu,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f", arena ? "arena" : "malloc", size,
+              n, arena ? chunk_sz : 0, rss, rss - size, padding, tail, header, current );
+    exit( 0 );
+}
+
+int main( int argc, char *argv[] )
+{
+    static const size_t sizes[] = { 8, 12, 16, 24, 32, 40, 48, 64, 100, 128, 200, 256 };
+    size_t millions = 1, chunk_sz = 65536;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "n:c:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'n': millions = strtoul( optarg, NULL, 10 ); break;
+        case 'c': chunk_sz = strtoul( optarg, NULL, 10 ); break;
+        default:
+            fprintf( stderr, "usage: %s [-n millions of objects] [-c chunk_sz]\n", argv[0] );
+            return 2;
+        }
+    }
+    bench_csv_header( "backend,size,objects,chunk_sz,rss_per_object,overhead_per_object,"
+                     "padding_per_object,tail_per_object,header_per_object,current_per_object" );
+    for ( size_t s = 0; s < sizeof sizes / sizeof *sizes; ++s ) {
+        run( true, sizes[s], millions * 1000000, chunk_sz );
+        run( false, sizes[s], millions * 1000000, chunk_sz );
+    }
+    return 0;
+}
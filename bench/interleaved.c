@@ -0,0 +1,60 @@
+/**
+ * @file
+ * @brief Benchmark for many arenas used interleaved, which is what stresses the descriptors.
+ * Every round allocates one object from each arena in turn, so consecutive calls never
+ * hit the same arena twice in a row.
+ * gcc -std=c99 -O2 -Isrc -o interleaved bench/interleaved.c src/core_arena.c
+ * usage: interleaved [arenas] [objects per arena and lifetime] [lifetimes] [align]
+ * An align other than 0 creates the arenas with arena_create_aligned().
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "core_arena.h"
+
+static double now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main( int argc, char *argv[] )
+{
+    size_t narenas = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 256;
+    size_t nobjs = argc > 2 ? strtoul( argv[2], NULL, 10 ) : 4096;
+    size_t lifetimes = argc > 3 ? strtoul( argv[3], NULL, 10 ) : 50;
+    size_t align = argc > 4 ? strtoul( argv[4], NULL, 10 ) : 0;
+    static const size_t sizes[] = { 8, 24, 16, 40, 32, 64, 8, 120 };
+
+    arena_init_arenas( narenas );
+    for ( size_t n = 0; n < narenas; ++n ) {
+        arena_create_aligned( n, 4096, align );
+    }
+
+    unsigned long sum = 0;
+    double start = now();
+    for ( size_t l = 0; l < lifetimes; ++l ) {
+        for ( size_t i = 0; i < nobjs; ++i ) {
+            for ( size_t n = 0; n < narenas; ++n ) {
+                char *p = arena_alloc( n, sizes[( i + n ) & 7] );
+                p[0] = ( char ) i;
+                sum += ( unsigned long ) p[0];
+            }
+        }
+        for ( size_t n = 0; n < narenas; ++n ) {
+            arena_dealloc( n );
+        }
+    }
+    double elapsed = now() - start;
+    double calls = ( double ) narenas * nobjs * lifetimes;
+
+    printf( "arenas=%zu objects=%zu lifetimes=%zu align=%zu calls=%.0f seconds=%.6f ns_per_alloc=%.2f (%lu)\n",
+           narenas, nobjs, lifetimes, align, calls, elapsed, elapsed * 1e9 / calls, sum & 1 );
+
+    for ( size_t n = 0; n < narenas; ++n ) {
+        arena_destroy( n );
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+/**
+ * @file
+ * @brief Tail latency of arena_alloc, every call timed on its own with clock_gettime, less the
+ * cost of reading the clock, and classified by what it did:
+ *  fast     Served from the current chunk.
+ *  refill   Served after _alloc() moved on to a chunk retained from an earlier lifetime.
+ *  malloc   Served after _alloc() malloc'ed a new chunk.
+ * and, for each of those, whether the call took a page fault, which is counted as the
+ * first touch of a page, as arena_alloc zeroes what it hands out. The first lifetime, where
+ * the chunks are new, and the later ones, served from the retained chunks, are reported
+ * apart, with p50/p99/p999/max per class, as CSV. Built by `make bench`.
+ * usage: latency [-c chunk_sz] [-s min size] [-S max size] [-n calls per lifetime] [-l lifetimes]
+ *
+ * A call is a refill when the pointer it returns doesn't follow the previous one, and a
+ * malloc when the number of mallocs in the statistics of the arena went up too. The faults
+ * are the minor and major faults of getrusage(), read outside the timed part. The library
+ * has no prefaulting or background refill, so the fault classes show what such features
+ * would take off the tail.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "core_arena.h"
+#include "bench.h"
+
+enum { FAST, REFILL, MALLOC, CLASSES };
+static const char *class_names[] = { "fast", "refill", "malloc" };
+
+static long faults( void )
+{
+    struct rusage ru;
+    getrusage( RUSAGE_SELF, &ru );
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+static uint64_t rng = 88172645463325252u;
+
+static uint64_t rnd( void )
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+int main( int argc, char *argv[] )
+{
+    static const char *usage = "usage: %s [-c chunk_sz] [-s min size] [-S max size] "
+                               "[-n calls per lifetime] [-l lifetimes]\n";
+    size_t chunk_sz = 4096, min_size = 8, max_size = 256, calls = 100000, lifetimes = 10;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "c:s:S:n:l:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'c': chunk_sz = strtoul( optarg, NULL, 10 ); break;
+        case 's': min_size = strtoul( optarg, NULL, 10 ); break;
+        case 'S': max_size = strtoul( optarg, NULL, 10 ); break;
+        case 'n': calls = strtoul( optarg, NULL, 10 ); break;
+        case 'l': lifetimes = strtoul( optarg, NULL, 10 ); break;
+        default:
+            fprintf( stderr, usage, argv[0] );
+            return 2;
+        }
+    }
+    if ( !min_size || max_size < min_size || !calls || !lifetimes ) {
+        fprintf( stderr, usage, argv[0] );
+        return 2;
+    }
+
+    size_t n = calls * lifetimes;
+    uint64_t *lat = malloc( n * sizeof *lat ), *sel = malloc( n * sizeof *sel );
+    unsigned char *cls = malloc( n );
+    size_t *sizes = malloc( calls * sizeof *sizes );
+    if ( !lat || !sel || !cls || !sizes ) {
+        fprintf( stderr, "latency: out of memory\n" );
+        return 1;
+    }
+    for ( size_t i = 0; i < calls; ++i ) {
+        sizes[i] = min_size + rnd() % ( max_size - min_size + 1 );
+    }
+
+    arena_init_arenas( 1 );
+    arena_create( 0, chunk_sz );
+    struct arena_stats st;
+    arena_stats( 0, &st );
+    unsigned long long mallocs = st.mallocs;
+    bench_timer_overhead();
+    for ( size_t l = 0, k = 0; l < lifetimes; ++l ) {
+        char *expected = NULL;
+        for ( size_t i = 0; i < calls; ++i, ++k ) {
+            long f = faults();
+            uint64_t t0 = bench_ns();
+            char *p = arena_alloc( 0, sizes[i] );
+            uint64_t t = bench_ns() - t0;
+            lat[k] = t > bench_timer_overhead() ? t - bench_timer_overhead() : 0;
+            cls[k] = FAST;
+            if ( expected && p != expected ) {
+                arena_stats( 0, &st );
+                cls[k] = st.mallocs != mallocs ? MALLOC : REFILL;
+                mallocs = st.mallocs;
+            }
+            if ( faults() != f ) {
+                cls[k] |= 4;
+            }
+            expected = p + ( ( sizes[i] + MAX_ALIGN - 1 ) & ~( size_t ) ( MAX_ALIGN - 1 ) );
+        }
+        arena_dealloc( 0 );
+    }
+    arena_destroy( 0 );
+
+    bench_csv_header( "phase,class,faulted,calls,mean_ns,p50_ns,p99_ns,p999_ns,max_ns" );
+    for ( int phase = 0; phase < 2; ++phase ) {
+        size_t from = phase ? calls : 0, to = phase ? n : calls;
+        for ( int c = -1; c < 2 * CLASSES; ++c ) {
+            size_t m = 0;
+            uint64_t sum = 0;
+            for ( size_t k = from; k < to; ++k ) {
+                int kc = ( cls[k] & 3 ) * 2 + ( cls[k] >> 2 );
+                if ( c < 0 || kc == c ) {
+                    sel[m++] = lat[k];
+                    sum += lat[k];
+                }
+            }
+            if ( !m ) {
+                continue;
+            }
+            bench_csv( "latency,%s,%s,%s,%zu,%.1f,%llu,%llu,%llu,%llu", phase ? "steady" : "first",
+                      c < 0 ? "all" : class_names[c / 2], c < 0 ? "any" : c & 1 ? "yes" : "no", m,
+                      ( double ) sum / m, ( unsigned long long ) bench_percentile( sel, m, 0.5 ),
+                      ( unsigned long long ) bench_percentile( sel, m, 0.99 ),
+                      ( unsigned long long ) bench_percentile( sel, m, 0.999 ),
+                      ( unsigned long long ) bench_percentile( sel, m, 1.0 ) );
+        }
+    }
+    free( lat );
+    free( sel );
+    free( cls );
+    free( sizes );
+    return 0;
+}
@@ -0,0 +1,291 @@
+/**
+ * @file
+ * @brief Locality: how fast structures built in arena memory and in malloc memory are traversed.
+ * K linked lists, binary search trees or hash chained tables, with N nodes between them,
+ * are built in one of the layouts:
+ *  malloc            With malloc, one structure after the other.
+ *  malloc_mixed      With malloc, a node for each structure in turn, so they interleave.
+ *  arena             In one arena, one structure after the other.
+ *  arena_mixed       In one arena, a node for each structure in turn.
+ *  arenas_mixed      In an arena per structure, a node for each structure in turn, which is
+ *                    what arenas are for, and run with different chunk sizes, alignments
+ *                    and colouring.
+ * and then traversed: the lists from head to tail, the trees in order, and the tables by
+ * looking up every key in random order. The colouring shifts where the nodes of the chunks
+ * of arena k start by k cache lines modulo a page, so page aligned chunks of different
+ * arenas don't compete for the same cache sets. The library doesn't colour, so the
+ * benchmark does it, by allocating the offset when a node starts a new chunk, which costs
+ * that node's slot. Every run is forked, and the results, with the hardware counters per
+ * traversal, are printed as CSV. Built by `make bench`.
+ * usage: locality [-n nodes] [-k structures] [-r traversals] [-s list|tree|hash|all]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "core_arena.h"
+#include "bench.h"
+
+enum layout { MALLOC, MALLOC_MIXED, ARENA, ARENA_MIXED, ARENAS_MIXED };
+static const char *layout_names[] = { "malloc", "malloc_mixed", "arena", "arena_mixed", "arenas_mixed" };
+
+struct config {
+    enum layout layout;
+    size_t chunk_sz, align;
+    bool colour;
+};
+
+static const struct config configs[] = {
+    { MALLOC, 0, 0, false },
+    { MALLOC_MIXED, 0, 0, false },
+    { ARENA, 65536, 0, false },
+    { ARENA_MIXED, 65536, 0, false },
+    { ARENAS_MIXED, 4096, 0, false },
+    { ARENAS_MIXED, 65536, 0, false },
+    { ARENAS_MIXED, 1 << 20, 0, false },
+    { ARENAS_MIXED, 65536, CACHE_LINE_SIZE, false },
+    { ARENAS_MIXED, 65536, 4096, false },
+    { ARENAS_MIXED, 65536, 4096, true },
+};
+
+static struct config cfg;
+static char **expected; /**< Where the next node of each arena goes if its chunk has room. */
+
+static void *node_alloc( size_t k, size_t size )
+{
+    void *p;
+    if ( cfg.layout == MALLOC || cfg.layout == MALLOC_MIXED ) {
+        p = malloc( size );
+    } else {
+        size_t n = cfg.layout == ARENAS_MIXED ? k : 0;
+        p = arena_alloc( n, size );
+        if ( cfg.colour && p != expected[n] ) { // A new chunk, colour it.
+            size_t offset = n * CACHE_LINE_SIZE % 4096;
+            if ( offset ) {
+                arena_alloc( n, offset );
+                p = arena_alloc( n, size );
+            }
+        }
+        expected[n] = ( char * ) p + ( ( size + MAX_ALIGN - 1 ) & ~( size_t ) ( MAX_ALIGN - 1 ) );
+    }
+    if ( !p ) {
+        fprintf( stderr, "locality: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+struct node {
+    struct node *next, *left; /**< next is the right child in the trees. */
+    uint64_t key, val;
+};
+
+static uint64_t rng = 88172645463325252u;
+
+static uint64_t rnd( void )
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* The structures, built by adding node i to structure i % k. */
+
+static struct node **heads, **tails;
+static size_t nbuckets;
+
+static void list_add( size_t k, uint64_t key )
+{
+    struct node *n = node_alloc( k, sizeof *n );
+    *n = ( struct node ) { .key = key, .val = key * 3 };
+    if ( tails[k] ) {
+        tails[k]->next = n;
+    } else {
+        heads[k] = n;
+    }
+    tails[k] = n;
+}
+
+static uint64_t list_walk( size_t k )
+{
+    uint64_t sum = 0;
+    for ( struct node *n = heads[k]; n; n = n->next ) {
+        sum += n->val;
+    }
+    return sum;
+}
+
+static void tree_add( size_t k, uint64_t key )
+{
+    struct node *n = node_alloc( k, sizeof *n ), **link = &heads[k];
+    *n = ( struct node ) { .key = key, .val = key * 3 };
+    while ( *link ) {
+        link = key < ( *link )->key ? &( *link )->left : &( *link )->next;
+    }
+    *link = n;
+}
+
+static uint64_t tree_walk_node( const struct node *n )
+{
+    uint64_t sum = 0;
+    for ( ; n; n = n->next ) {
+        sum += tree_walk_node( n->left ) + n->val;
+    }
+    return sum;
+}
+
+static uint64_t tree_walk( size_t k )
+{
+    return tree_walk_node( heads[k] );
+}
+
+/** The tables, k arrays of nbuckets chains one after the other. */
+static struct node **tables;
+
+static void hash_add( size_t k, uint64_t key )
+{
+    struct node *n = node_alloc( k, sizeof *n );
+    struct node **bucket = &tables[k * nbuckets + key % nbuckets];
+    *n = ( struct node ) { .next = *bucket, .key = key, .val = key * 3 };
+    *bucket = n;
+}
+
+static uint64_t *lookups; /**< The keys of each table, in random order. */
+static size_t per_table;
+
+static uint64_t hash_walk( size_t k )
+{
+    uint64_t sum = 0;
+    for ( size_t i = 0; i < per_table; ++i ) {
+        uint64_t key = lookups[k * per_table + i];
+        for ( struct node *n = tables[k * nbuckets + key % nbuckets]; n; n = n->next ) {
+            if ( n->key == key ) {
+                sum += n->val;
+                break;
+            }
+        }
+    }
+    return sum;
+}
+
+static const struct {
+    const char *name;
+    void ( *add )( size_t k, uint64_t key );
+    uint64_t ( *walk )( size_t k );
+} structures[] = {
+    { "list", list_add, list_walk }, { "tree", tree_add, tree_walk }, { "hash", hash_add, hash_walk },
+};
+
+static void run( size_t s, size_t nodes, size_t k, size_t traversals )
+{
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+        perror( "fork" );
+        exit( 1 );
+    }
+    if ( pid ) {
+        waitpid( pid, NULL, 0 );
+        return;
+    }
+    per_table = nodes / k;
+    nodes = per_table * k;
+    nbuckets = per_table / 4 ? per_table / 4 : 1;
+    heads = calloc( k, sizeof *heads );
+    tails = calloc( k, sizeof *tails );
+    tables = calloc( k * nbuckets, sizeof *tables );
+    expected = calloc( k, sizeof *expected );
+    uint64_t *keys = malloc( nodes * sizeof *keys );
+    lookups = malloc( nodes * sizeof *lookups );
+    if ( !heads || !tails || !tables || !expected || !keys || !lookups ) {
+        fprintf( stderr, "locality: out of memory\n" );
+        exit( 1 );
+    }
+    for ( size_t i = 0; i < nodes; ++i ) {
+        keys[i] = rnd();
+    }
+    // The lookups of each table are its keys, shuffled.
+    for ( size_t t = 0; t < k; ++t ) {
+        uint64_t *l = lookups + t * per_table;
+        for ( size_t i = 0; i < per_table; ++i ) {
+            l[i] = keys[i * k + t];
+        }
+        for ( size_t i = per_table; i > 1; --i ) {
+            size_t j = rnd() % i;
+            uint64_t tmp = l[i - 1];
+            l[i - 1] = l[j];
+            l[j] = tmp;
+        }
+    }
+    if ( cfg.layout != MALLOC && cfg.layout != MALLOC_MIXED ) {
+        size_t narenas = cfg.layout == ARENAS_MIXED ? k : 1;
+        arena_init_arenas( narenas );
+        for ( size_t n = 0; n < narenas; ++n ) {
+            arena_create_aligned( n, cfg.chunk_sz, cfg.align );
+        }
+    }
+
+    bool mixed = cfg.layout != MALLOC && cfg.layout != ARENA;
+    uint64_t t0 = bench_ns();
+    for ( size_t i = 0; i < nodes; ++i ) {
+        // Node i goes to structure i % k, in turn, or to the structures one after the other.
+        size_t t = mixed ? i % k : i / per_table;
+        structures[s].add( t, keys[mixed ? i : ( i % per_table ) * k + t] );
+    }
+    double build = ( double ) ( bench_ns() - t0 ) / nodes;
+
+    struct bench_counters counters = { 0 };
+    uint64_t sum = 0;
+    bench_counters_begin();
+    t0 = bench_ns();
+    for ( size_t r = 0; r < traversals; ++r ) {
+        for ( size_t t = 0; t < k; ++t ) {
+            sum += structures[s].walk( t );
+        }
+    }
+    double walk = ( double ) ( bench_ns() - t0 ) / ( ( double ) nodes * traversals );
+    bench_counters_end( &counters );
+
+    char buf[256];
+    bench_csv( "locality,%s,%s,%zu,%zu,%d,%zu,%zu,%.2f,%.2f,%llu,%s", structures[s].name, layout_names[cfg.layout],
+              cfg.chunk_sz, cfg.align, cfg.colour, nodes, k, build, walk, ( unsigned long long ) ( sum & 0xffff ),
+              bench_counters_csv( buf, sizeof buf, &counters, ( double ) traversals ) );
+    exit( 0 );
+}
+
+int main( int argc, char *argv[] )
+{
+    static const char *usage = "usage: %s [-n nodes] [-k structures] [-r traversals] [-s list|tree|hash|all]\n";
+    size_t nodes = 1000000, k = 8, traversals = 5;
+    const char *which = "all";
+    int opt;
+    while ( ( opt = getopt( argc, argv, "n:k:r:s:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'n': nodes = strtoul( optarg, NULL, 10 ); break;
+        case 'k': k = strtoul( optarg, NULL, 10 ); break;
+        case 'r': traversals = strtoul( optarg, NULL, 10 ); break;
+        case 's': which = optarg; break;
+        default:
+            fprintf( stderr, usage, argv[0] );
+            return 2;
+        }
+    }
+    if ( !k || nodes < k || !traversals ) {
+        fprintf( stderr, usage, argv[0] );
+        return 2;
+    }
+    bench_csv_header( "structure,layout,chunk_sz,align,colour,nodes,structures,build_ns_per_node,"
+                     "walk_ns_per_node,checksum," BENCH_COUNTER_COLUMNS );
+    for ( size_t s = 0; s < sizeof structures / sizeof *structures; ++s ) {
+        if ( strcmp( which, "all" ) && strcmp( which, structures[s].name ) ) {
+            continue;
+        }
+        for ( size_t c = 0; c < sizeof configs / sizeof *configs; ++c ) {
+            cfg = configs[c];
+            run( s, nodes, k, traversals );
+        }
+    }
+    return 0;
+}
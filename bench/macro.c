@@ -0,0 +1,565 @@
+/**
+ * @file
+ * @brief End-to-end benchmarks of the workloads arenas are meant for, where the objects of a
+ * lifetime are allocated piecemeal, used together, and thrown away together:
+ *  parser  A recursive descent parser building ASTs of expressions, one file per lifetime.
+ *  intern  A string interning hash table, one batch of documents per lifetime.
+ *  graph   Building random graphs of adjacency lists and traversing them breadth first.
+ *  server  A server loop with one arena per request, parsing headers and building replies.
+ * Each runs against the arena or against malloc/free, which frees the data structures the
+ * way a program would, by walking them. Every run is forked, so the peak RSS is its own,
+ * and the results are printed as CSV, with the hardware counters per allocation, which
+ * cover the work done with the objects too. The checksums of the two backends must agree.
+ * Built by `make bench`.
+ * usage: macro [-b arena|malloc|all] [-w parser|intern|graph|server|all] [-n scale] [-c chunk_sz]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "core_arena.h"
+#include "bench.h"
+
+static bool use_arena;            /**< The backend of this run. */
+static unsigned long long allocs; /**< Allocations made by the workload. */
+
+static void *xalloc( size_t sz )
+{
+    allocs++;
+    void *p = use_arena ? arena_alloc( 0, sz ) : malloc( sz );
+    if ( !p ) {
+        fprintf( stderr, "macro: out of memory\n" );
+        exit( 1 );
+    }
+    return p;
+}
+
+/** Frees one object with malloc, the arena frees them all at the end of the lifetime. */
+static void xfree( void *p )
+{
+    if ( !use_arena ) {
+        free( p );
+    }
+}
+
+static void end_of_lifetime( void )
+{
+    if ( use_arena ) {
+        arena_dealloc( 0 );
+    }
+}
+
+static uint64_t rng = 88172645463325252u;
+
+static uint64_t rnd( void )
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/** A growable buffer for generating the inputs, outside the timed part. */
+struct text {
+    char *s;
+    size_t len, cap;
+};
+
+static void put( struct text *t, const char *s, size_t len )
+{
+    if ( t->len + len + 1 > t->cap ) {
+        t->cap = ( t->len + len + 1 ) * 2;
+        t->s = realloc( t->s, t->cap );
+        if ( !t->s ) {
+            fprintf( stderr, "macro: out of memory\n" );
+            exit( 1 );
+        }
+    }
+    memcpy( t->s + t->len, s, len );
+    t->len += len;
+    t->s[t->len] = '\0';
+}
+
+static void puts_( struct text *t, const char *s )
+{
+    put( t, s, strlen( s ) );
+}
+
+static void put_word( struct text *t, size_t minlen, size_t maxlen )
+{
+    char w[64];
+    size_t len = minlen + rnd() % ( maxlen - minlen + 1 );
+    for ( size_t i = 0; i < len; ++i ) {
+        w[i] = ( char ) ( 'a' + rnd() % 26 );
+    }
+    put( t, w, len );
+}
+
+/* The parser workload. */
+
+struct node {
+    char op;              /**< 0 for a number, 'v' for a variable, else the operator. */
+    long val;
+    char *name;
+    struct node *l, *r;
+};
+
+static const char *src;
+
+static struct node *parse_expr( void );
+
+static struct node *parse_factor( void )
+{
+    if ( *src == '(' ) {
+        src++;
+        struct node *n = parse_expr();
+        src++; // ')'
+        return n;
+    }
+    struct node *n = xalloc( sizeof *n );
+    memset( n, 0, sizeof *n );
+    if ( *src >= '0' && *src <= '9' ) {
+        while ( *src >= '0' && *src <= '9' ) {
+            n->val = n->val * 10 + ( *src++ - '0' );
+        }
+    } else {
+        const char *start = src;
+        while ( *src >= 'a' && *src <= 'z' ) {
+            src++;
+        }
+        n->op = 'v';
+        n->name = xalloc( ( size_t ) ( src - start ) + 1 );
+        memcpy( n->name, start, ( size_t ) ( src - start ) );
+        n->name[src - start] = '\0';
+    }
+    return n;
+}
+
+static struct node *binary( char op, struct node *l, struct node *r )
+{
+    struct node *n = xalloc( sizeof *n );
+    *n = ( struct node ) { .op = op, .l = l, .r = r };
+    return n;
+}
+
+static struct node *parse_term( void )
+{
+    struct node *n = parse_factor();
+    while ( *src == '*' || *src == '/' ) {
+        char op = *src++;
+        n = binary( op, n, parse_factor() );
+    }
+    return n;
+}
+
+static struct node *parse_expr( void )
+{
+    struct node *n = parse_term();
+    while ( *src == '+' || *src == '-' ) {
+        char op = *src++;
+        n = binary( op, n, parse_term() );
+    }
+    return n;
+}
+
+static long eval( const struct node *n )
+{
+    long l, r;
+    switch ( n->op ) {
+    case 0: return n->val;
+    case 'v': return ( long ) ( n->name[0] + strlen( n->name ) );
+    case '+': return eval( n->l ) + eval( n->r );
+    case '-': return eval( n->l ) - eval( n->r );
+    case '*': return ( eval( n->l ) * eval( n->r ) ) % 1000003;
+    default:
+        l = eval( n->l );
+        r = eval( n->r );
+        return r ? l / r : l;
+    }
+}
+
+static void free_tree( struct node *n )
+{
+    if ( n->l ) {
+        free_tree( n->l );
+        free_tree( n->r );
+    }
+    xfree( n->name );
+    xfree( n );
+}
+
+static void gen_expr( struct text *t, int depth )
+{
+    if ( depth == 0 || rnd() % 4 == 0 ) {
+        if ( rnd() & 1 ) {
+            char num[24];
+            puts_( t, ( snprintf( num, sizeof num, "%u", ( unsigned ) ( rnd() % 10000 ) ), num ) );
+        } else {
+            put_word( t, 1, 12 );
+        }
+        return;
+    }
+    bool paren = rnd() % 3 == 0;
+    if ( paren ) {
+        puts_( t, "(" );
+    }
+    gen_expr( t, depth - 1 );
+    put( t, &"+-*/"[rnd() % 4], 1 );
+    gen_expr( t, depth - 1 );
+    if ( paren ) {
+        puts_( t, ")" );
+    }
+}
+
+static long parser( size_t scale )
+{
+    struct text t = { 0 };
+    for ( size_t i = 0; i < 2000; ++i ) {
+        gen_expr( &t, 10 );
+        puts_( &t, ";" );
+    }
+    long sum = 0;
+    for ( size_t file = 0; file < 20 * scale; ++file ) {
+        struct node *trees[2000];
+        size_t n = 0;
+        for ( src = t.s; *src; src++ ) { // Skips the ';'.
+            trees[n++] = parse_expr();
+        }
+        for ( size_t i = 0; i < n; ++i ) {
+            sum += eval( trees[i] );
+            if ( !use_arena ) {
+                free_tree( trees[i] );
+            }
+        }
+        end_of_lifetime();
+    }
+    free( t.s );
+    return sum;
+}
+
+/* The interning workload. */
+
+struct entry {
+    struct entry *next;
+    uint64_t hash;
+    unsigned count;
+    char str[];
+};
+
+static uint64_t fnv( const char *s, size_t len )
+{
+    uint64_t h = 14695981039346656037u;
+    for ( size_t i = 0; i < len; ++i ) {
+        h = ( h ^ ( unsigned char ) s[i] ) * 1099511628211u;
+    }
+    return h;
+}
+
+static long intern( size_t scale )
+{
+    // A vocabulary, and documents drawing words from it with a skew to the common ones.
+    enum { VOCAB = 20000, WORDS = 200000 };
+    struct text vocab = { 0 };
+    size_t *offs = malloc( ( VOCAB + 1 ) * sizeof *offs );
+    for ( size_t v = 0; v < VOCAB; ++v ) {
+        offs[v] = vocab.len;
+        put_word( &vocab, 3, 12 );
+    }
+    offs[VOCAB] = vocab.len;
+    unsigned *words = malloc( WORDS * sizeof *words );
+    for ( size_t i = 0; i < WORDS; ++i ) {
+        size_t common = rnd() % VOCAB + 1;
+        words[i] = ( unsigned ) ( rnd() % common );
+    }
+
+    long sum = 0;
+    for ( size_t batch = 0; batch < 10 * scale; ++batch ) {
+        size_t nbuckets = 1024, nentries = 0;
+        struct entry **table = xalloc( nbuckets * sizeof *table );
+        memset( table, 0, nbuckets * sizeof *table );
+        for ( size_t i = 0; i < WORDS; ++i ) {
+            const char *w = vocab.s + offs[words[i]];
+            size_t len = offs[words[i] + 1] - offs[words[i]];
+            uint64_t h = fnv( w, len );
+            struct entry *e;
+            for ( e = table[h & ( nbuckets - 1 )]; e; e = e->next ) {
+                if ( e->hash == h && !memcmp( e->str, w, len ) && !e->str[len] ) {
+                    break;
+                }
+            }
+            if ( !e ) {
+                e = xalloc( sizeof *e + len + 1 );
+                e->hash = h;
+                e->count = 0;
+                memcpy( e->str, w, len );
+                e->str[len] = '\0';
+                e->next = table[h & ( nbuckets - 1 )];
+                table[h & ( nbuckets - 1 )] = e;
+                if ( ++nentries > nbuckets ) { // Grow, the old table is left in the arena.
+                    struct entry **grown = xalloc( 2 * nbuckets * sizeof *grown );
+                    memset( grown, 0, 2 * nbuckets * sizeof *grown );
+                    for ( size_t b = 0; b < nbuckets; ++b ) {
+                        for ( struct entry *next, *x = table[b]; x; x = next ) {
+                            next = x->next;
+                            x->next = grown[x->hash & ( 2 * nbuckets - 1 )];
+                            grown[x->hash & ( 2 * nbuckets - 1 )] = x;
+                        }
+                    }
+                    xfree( table );
+                    table = grown;
+                    nbuckets *= 2;
+                }
+            }
+            e->count++;
+        }
+        for ( size_t b = 0; b < nbuckets; ++b ) {
+            for ( struct entry *next, *e = table[b]; e; e = next ) {
+                next = e->next;
+                sum += ( long ) e->count * ( long ) e->str[0];
+                xfree( e );
+            }
+        }
+        xfree( table );
+        end_of_lifetime();
+    }
+    free( vocab.s );
+    free( offs );
+    free( words );
+    return sum;
+}
+
+/* The graph workload. */
+
+struct edge {
+    unsigned to;
+    struct edge *next;
+};
+
+struct vertex {
+    struct edge *adj;
+    long dist;
+};
+
+static long graph( size_t scale )
+{
+    enum { VERTICES = 50000, DEGREE = 8 };
+    long sum = 0;
+    for ( size_t g = 0; g < 10 * scale; ++g ) {
+        struct vertex *v = xalloc( VERTICES * sizeof *v );
+        for ( size_t i = 0; i < VERTICES; ++i ) {
+            v[i].adj = NULL;
+            v[i].dist = -1;
+        }
+        for ( size_t i = 0; i < VERTICES * DEGREE / 2; ++i ) {
+            unsigned a = ( unsigned ) ( rnd() % VERTICES ), b = ( unsigned ) ( rnd() % VERTICES );
+            struct edge *e = xalloc( sizeof *e );
+            *e = ( struct edge ) { b, v[a].adj };
+            v[a].adj = e;
+            e = xalloc( sizeof *e );
+            *e = ( struct edge ) { a, v[b].adj };
+            v[b].adj = e;
+        }
+        unsigned *queue = xalloc( VERTICES * sizeof *queue );
+        size_t head = 0, tail = 0;
+        queue[tail++] = 0;
+        v[0].dist = 0;
+        while ( head < tail ) {
+            unsigned u = queue[head++];
+            sum += v[u].dist;
+            for ( struct edge *e = v[u].adj; e; e = e->next ) {
+                if ( v[e->to].dist < 0 ) {
+                    v[e->to].dist = v[u].dist + 1;
+                    queue[tail++] = e->to;
+                }
+            }
+        }
+        if ( !use_arena ) {
+            for ( size_t i = 0; i < VERTICES; ++i ) {
+                for ( struct edge *next, *e = v[i].adj; e; e = next ) {
+                    next = e->next;
+                    free( e );
+                }
+            }
+        }
+        xfree( queue );
+        xfree( v );
+        end_of_lifetime();
+    }
+    return sum;
+}
+
+/* The server workload. */
+
+struct header {
+    char *name, *value;
+    struct header *next;
+};
+
+static char *dup_n( const char *s, size_t len )
+{
+    char *d = xalloc( len + 1 );
+    memcpy( d, s, len );
+    d[len] = '\0';
+    return d;
+}
+
+static long server( size_t scale )
+{
+    enum { REQUESTS = 2000 };
+    struct text reqs = { 0 };
+    size_t *offs = malloc( ( REQUESTS + 1 ) * sizeof *offs );
+    for ( size_t r = 0; r < REQUESTS; ++r ) {
+        offs[r] = reqs.len;
+        puts_( &reqs, "GET /" );
+        put_word( &reqs, 4, 40 );
+        puts_( &reqs, " HTTP/1.1\r\n" );
+        for ( size_t h = 5 + rnd() % 16; h; --h ) {
+            put_word( &reqs, 3, 16 );
+            puts_( &reqs, ": " );
+            put_word( &reqs, 4, 60 );
+            puts_( &reqs, "\r\n" );
+        }
+        puts_( &reqs, "\r\n" );
+    }
+    offs[REQUESTS] = reqs.len;
+
+    long sum = 0;
+    for ( size_t i = 0; i < 50000 * scale; ++i ) {
+        const char *p = reqs.s + offs[i % REQUESTS];
+        const char *eol = strstr( p, "\r\n" );
+        char *line = dup_n( p, ( size_t ) ( eol - p ) );
+        struct header *headers = NULL;
+        size_t n = 0, total = strlen( line ) + 2;
+        for ( p = eol + 2; p[0] != '\r'; p = eol + 2 ) {
+            eol = strstr( p, "\r\n" );
+            const char *colon = memchr( p, ':', ( size_t ) ( eol - p ) );
+            struct header *h = xalloc( sizeof *h );
+            h->name = dup_n( p, ( size_t ) ( colon - p ) );
+            h->value = dup_n( colon + 2, ( size_t ) ( eol - colon - 2 ) );
+            h->next = headers;
+            headers = h;
+            n++;
+        }
+        // The reply echoes the headers, built in pieces and then joined.
+        char **pieces = xalloc( ( n + 1 ) * sizeof *pieces );
+        size_t np = 0;
+        pieces[np++] = dup_n( "HTTP/1.1 200 OK\r\n", 17 );
+        for ( struct header *h = headers; h; h = h->next ) {
+            size_t len = 7 + strlen( h->name ) + 2 + strlen( h->value ) + 2;
+            char *piece = xalloc( len + 1 );
+            snprintf( piece, len + 1, "X-Echo-%s: %s\r\n", h->name, h->value );
+            pieces[np++] = piece;
+            total += len;
+        }
+        char *reply = xalloc( total + 1 ), *q = reply;
+        for ( size_t k = 0; k < np; ++k ) {
+            size_t len = strlen( pieces[k] );
+            memcpy( q, pieces[k], len );
+            q += len;
+            xfree( pieces[k] );
+        }
+        *q = '\0';
+        sum += ( long ) ( q - reply ) + reply[q - reply - 3];
+        if ( !use_arena ) {
+            for ( struct header *next, *h = headers; h; h = next ) {
+                next = h->next;
+                free( h->name );
+                free( h->value );
+                free( h );
+            }
+        }
+        xfree( pieces );
+        xfree( reply );
+        xfree( line );
+        end_of_lifetime(); // The arena of the request.
+    }
+    free( reqs.s );
+    free( offs );
+    return sum;
+}
+
+static const struct {
+    const char *name;
+    long ( *run )( size_t scale );
+} workloads[] = {
+    { "parser", parser }, { "intern", intern }, { "graph", graph }, { "server", server },
+};
+
+/** Runs a workload in a child, so that the peak RSS is that of the workload alone. */
+static void run( size_t w, bool arena, size_t scale, size_t chunk_sz )
+{
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+        perror( "fork" );
+        exit( 1 );
+    }
+    if ( pid ) {
+        int status;
+        waitpid( pid, &status, 0 );
+        if ( !WIFEXITED( status ) || WEXITSTATUS( status ) ) {
+            fprintf( stderr, "macro: %s failed\n", workloads[w].name );
+        }
+        return;
+    }
+    use_arena = arena;
+    if ( arena ) {
+        arena_init_arenas( 1 );
+        arena_create( 0, chunk_sz );
+    }
+    struct bench_counters counters = { 0 };
+    char buf[256];
+    bench_counters_begin();
+    uint64_t t0 = bench_ns();
+    long sum = workloads[w].run( scale );
+    double seconds = ( bench_ns() - t0 ) / 1e9;
+    bench_counters_end( &counters );
+    if ( arena ) {
+        arena_destroy( 0 );
+    }
+    bench_csv( "macro,%s,%s,%zu,%.6f,%ld,%llu,%.0f,%ld,%s", workloads[w].name, arena ? "arena" : "malloc",
+              arena ? chunk_sz : 0, seconds, bench_peak_rss_kb(), allocs, allocs / seconds, sum,
+              bench_counters_csv( buf, sizeof buf, &counters, ( double ) allocs ) );
+    exit( 0 );
+}
+
+int main( int argc, char *argv[] )
+{
+    static const char *usage = "usage: %s [-b arena|malloc|all] [-w parser|intern|graph|server|all] "
+                               "[-n scale] [-c chunk_sz]\n";
+    const char *backend = "all", *workload = "all";
+    size_t scale = 1, chunk_sz = 4096;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "b:w:n:c:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'b': backend = optarg; break;
+        case 'w': workload = optarg; break;
+        case 'n': scale = strtoul( optarg, NULL, 10 ); break;
+        case 'c': chunk_sz = strtoul( optarg, NULL, 10 ); break;
+        default:
+            fprintf( stderr, usage, argv[0] );
+            return 2;
+        }
+    }
+    bool any = false;
+    bench_csv_header( "workload,backend,chunk_sz,seconds,peak_rss_kb,allocs,allocs_per_sec,checksum,"
+                     BENCH_COUNTER_COLUMNS );
+    for ( size_t w = 0; w < sizeof workloads / sizeof *workloads; ++w ) {
+        if ( strcmp( workload, "all" ) && strcmp( workload, workloads[w].name ) ) {
+            continue;
+        }
+        for ( int arena = 1; arena >= 0; --arena ) {
+            if ( strcmp( backend, "all" ) && strcmp( backend, arena ? "arena" : "malloc" ) ) {
+                continue;
+            }
+            run( w, arena, scale, chunk_sz );
+            any = true;
+        }
+    }
+    if ( !any ) {
+        fprintf( stderr, usage, argv[0] );
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,251 @@
+/**
+ * @file
+ * @brief Microbenchmarks of arena_alloc, arena_calloc, arena_dealloc and arena_destroy, against
+ * glibc malloc/free and a naive bump allocator, across request sizes, chunk sizes and
+ * lifetime lengths. Built and run by `make bench`, which prints the results as CSV.
+ * usage: micro [calls per case]
+ *
+ * Every case runs its calls as lifetimes of a number of objects. Half of the lifetimes are
+ * timed as a whole, for the throughput, and in the other half every call is timed on its
+ * own, for the latency percentiles, less the cost of reading the clock. For malloc, a
+ * dealloc frees the objects of the lifetime one by one, and for the bump allocator it frees
+ * its chunks, as it keeps nothing between lifetimes. A destroy is timed after one lifetime
+ * of allocations. Note that arena_alloc zeroes the memory it hands out, like calloc.
+ * The hardware counters are per call, and cover the lifetimes timed as a whole.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "core_arena.h"
+#include "bench.h"
+
+enum impl { ARENA, MALLOC, BUMP };
+static const char *impl_names[] = { "arena", "malloc", "bump" };
+
+/** The naive bump allocator: a list of malloc'ed chunks, no retention, no statistics. */
+struct bump {
+    char *head, *begin, *end;
+    size_t chunk_sz;
+};
+
+#define BUMP_HDR 16 /**< The link to the next chunk, padded to the alignment. */
+
+static void *bump_alloc( struct bump *b, size_t size )
+{
+    size = ( size + 15 ) & ~( size_t ) 15;
+    if ( size > ( size_t ) ( b->end - b->begin ) ) {
+        size_t sz = size + BUMP_HDR > b->chunk_sz ? size + BUMP_HDR : b->chunk_sz;
+        char *chunk = malloc( sz );
+        if ( !chunk ) {
+            return NULL;
+        }
+        *( char ** ) chunk = b->head;
+        b->head = chunk;
+        b->begin = chunk + BUMP_HDR;
+        b->end = chunk + sz;
+    }
+    void *p = b->begin;
+    b->begin += size;
+    return p;
+}
+
+static void bump_reset( struct bump *b )
+{
+    while ( b->head ) {
+        char *next = *( char ** ) b->head;
+        free( b->head );
+        b->head = next;
+    }
+    b->begin = b->end = NULL;
+}
+
+/** The state of one case. */
+struct bench_case {
+    enum impl impl;
+    size_t size, chunk_sz, lifetime;
+    struct bump bump;
+    void **ptrs; /**< The objects of a lifetime, for free(). */
+};
+
+static void *do_alloc( struct bench_case *c, size_t i, bool zero )
+{
+    void *p;
+    switch ( c->impl ) {
+    case ARENA:
+        p = zero ? arena_calloc( 0, 1, c->size ) : arena_alloc( 0, c->size );
+        break;
+    case MALLOC:
+        p = c->ptrs[i] = zero ? calloc( 1, c->size ) : malloc( c->size );
+        break;
+    default:
+        p = bump_alloc( &c->bump, c->size );
+        if ( zero && p ) {
+            memset( p, 0, c->size );
+        }
+        break;
+    }
+    if ( !p ) {
+        fprintf( stderr, "micro: out of memory\n" );
+        exit( 1 );
+    }
+    *( volatile char * ) p = 1;
+    return p;
+}
+
+static void do_dealloc( struct bench_case *c )
+{
+    switch ( c->impl ) {
+    case ARENA:
+        arena_dealloc( 0 );
+        break;
+    case MALLOC:
+        for ( size_t i = 0; i < c->lifetime; ++i ) {
+            free( c->ptrs[i] );
+        }
+        break;
+    default:
+        bump_reset( &c->bump );
+        break;
+    }
+}
+
+static void do_create( struct bench_case *c )
+{
+    if ( c->impl == ARENA ) {
+        arena_create( 0, c->chunk_sz );
+    }
+}
+
+static void do_destroy( struct bench_case *c )
+{
+    if ( c->impl == ARENA ) {
+        arena_destroy( 0 );
+    } else {
+        do_dealloc( c );
+    }
+}
+
+static void report( const struct bench_case *c, const char *op, unsigned long long calls, uint64_t ns,
+                   uint64_t *lat, size_t nlat, const struct bench_counters *counters )
+{
+    char buf[256];
+    bench_csv( "micro,%s,%s,%zu,%zu,%zu,%llu,%.6f,%.2f,%llu,%llu,%llu,%s", impl_names[c->impl], op, c->size,
+              c->chunk_sz, c->lifetime, calls, ns / 1e9, calls ? ( double ) ns / calls : 0.0,
+              ( unsigned long long ) bench_percentile( lat, nlat, 0.5 ),
+              ( unsigned long long ) bench_percentile( lat, nlat, 0.99 ),
+              ( unsigned long long ) bench_percentile( lat, nlat, 1.0 ),
+              bench_counters_csv( buf, sizeof buf, counters, calls ? ( double ) calls : 1.0 ) );
+}
+
+static uint64_t since( uint64_t t0 )
+{
+    uint64_t t = bench_ns() - t0, overhead = bench_timer_overhead();
+    return t > overhead ? t - overhead : 0;
+}
+
+/** Runs the alloc or calloc calls of a case, and the deallocs between its lifetimes. */
+static void run_allocs( struct bench_case *c, size_t calls, bool zero, uint64_t *lat, uint64_t *dlat )
+{
+    size_t lifetimes = calls / c->lifetime ? calls / c->lifetime : 1;
+    uint64_t ns = 0, dns = 0;
+    unsigned long long timed = 0;
+    size_t nlat = 0;
+    struct bench_counters counters = { 0 }, dcounters = { 0 };
+    do_create( c );
+    for ( size_t l = 0; l < lifetimes; ++l ) {
+        if ( l & 1 ) {
+            for ( size_t i = 0; i < c->lifetime; ++i ) {
+                uint64_t t0 = bench_ns();
+                do_alloc( c, i, zero );
+                lat[nlat++] = since( t0 );
+            }
+        } else {
+            bench_counters_begin();
+            uint64_t t0 = bench_ns();
+            for ( size_t i = 0; i < c->lifetime; ++i ) {
+                do_alloc( c, i, zero );
+            }
+            ns += bench_ns() - t0;
+            bench_counters_end( &counters );
+            timed += c->lifetime;
+        }
+        bench_counters_begin();
+        uint64_t t0 = bench_ns();
+        do_dealloc( c );
+        dlat[l] = since( t0 );
+        bench_counters_end( &dcounters );
+        dns += dlat[l];
+    }
+    if ( c->impl == ARENA ) { // Only the arena keeps memory after a dealloc.
+        arena_destroy( 0 );
+    }
+    report( c, zero ? "calloc" : "alloc", timed, ns, lat, nlat, &counters );
+    if ( !zero ) {
+        report( c, "dealloc", lifetimes, dns, dlat, lifetimes, &dcounters );
+    }
+}
+
+static void run_destroys( struct bench_case *c, size_t calls, uint64_t *lat )
+{
+    size_t n = calls / c->lifetime ? calls / c->lifetime : 1;
+    uint64_t ns = 0;
+    struct bench_counters counters = { 0 };
+    if ( n > 1000 ) {
+        n = 1000;
+    }
+    for ( size_t r = 0; r < n; ++r ) {
+        do_create( c );
+        for ( size_t i = 0; i < c->lifetime; ++i ) {
+            do_alloc( c, i, false );
+        }
+        bench_counters_begin();
+        uint64_t t0 = bench_ns();
+        do_destroy( c );
+        lat[r] = since( t0 );
+        bench_counters_end( &counters );
+        ns += lat[r];
+    }
+    report( c, "destroy", n, ns, lat, n, &counters );
+}
+
+int main( int argc, char *argv[] )
+{
+    static const size_t sizes[] = { 8, 64, 512, 4096 };
+    static const size_t chunk_szs[] = { 1024, 4096, 65536 };
+    static const size_t lifetimes[] = { 16, 1024, 65536 };
+    size_t calls = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 1 << 20;
+    size_t max_lifetime = lifetimes[sizeof lifetimes / sizeof *lifetimes - 1];
+    size_t nlat = calls > max_lifetime ? calls : max_lifetime;
+
+    uint64_t *lat = malloc( nlat * sizeof *lat ), *dlat = malloc( nlat * sizeof *dlat );
+    void **ptrs = malloc( max_lifetime * sizeof *ptrs );
+    if ( !lat || !dlat || !ptrs ) {
+        fprintf( stderr, "micro: out of memory\n" );
+        return 1;
+    }
+    arena_init_arenas( 1 );
+    bench_csv_header( "impl,op,size,chunk_sz,lifetime,calls,seconds,ns_per_call,p50_ns,p99_ns,max_ns,"
+                     BENCH_COUNTER_COLUMNS );
+    for ( size_t s = 0; s < sizeof sizes / sizeof *sizes; ++s ) {
+        for ( size_t l = 0; l < sizeof lifetimes / sizeof *lifetimes; ++l ) {
+            for ( int impl = ARENA; impl <= BUMP; ++impl ) {
+                // malloc has no chunks, so it is run once.
+                size_t nchunks = impl == MALLOC ? 1 : sizeof chunk_szs / sizeof *chunk_szs;
+                for ( size_t k = 0; k < nchunks; ++k ) {
+                    struct bench_case c = { .impl = ( enum impl ) impl, .size = sizes[s],
+                                            .chunk_sz = impl == MALLOC ? 0 : chunk_szs[k],
+                                            .lifetime = lifetimes[l], .ptrs = ptrs };
+                    c.bump.chunk_sz = c.chunk_sz;
+                    run_allocs( &c, calls, false, lat, dlat );
+                    run_allocs( &c, calls, true, lat, dlat );
+                    run_destroys( &c, calls, lat );
+                }
+            }
+        }
+    }
+    free( lat );
+    free( dlat );
+    free( ptrs );
+    return 0;
+}
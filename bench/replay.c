@@ -0,0 +1,120 @@
+/**
+ * @file
+ * @brief Replays an allocation trace recorded with arena_trace_start() against the library, so
+ * chunk sizes and layouts can be benchmarked offline on the allocations of a real run.
+ * gcc -std=c99 -O2 -Isrc -o replay bench/replay.c bench/trace.c src/core_arena.c
+ * usage: replay [-c chunk_sz] [-a align] [-r repeat] trace
+ * -c and -a override the chunk_sz and alignment of every arena_create in the trace.
+ * Arenas the trace allocates from without creating them, because the trace was started
+ * after they were, are created with the chunk_sz of -c, or 4096.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "core_arena.h"
+#include "trace.h"
+
+static double now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main( int argc, char *argv[] )
+{
+    size_t chunk_sz = 0, align = 0, repeat = 1;
+    bool align_set = false;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "c:a:r:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'c': chunk_sz = strtoul( optarg, NULL, 10 ); break;
+        case 'a': align = strtoul( optarg, NULL, 10 ); align_set = true; break;
+        case 'r': repeat = strtoul( optarg, NULL, 10 ); break;
+        default:
+            fprintf( stderr, "usage: %s [-c chunk_sz] [-a align] [-r repeat] trace\n", argv[0] );
+            return 2;
+        }
+    }
+    if ( optind != argc - 1 ) {
+        fprintf( stderr, "usage: %s [-c chunk_sz] [-a align] [-r repeat] trace\n", argv[0] );
+        return 2;
+    }
+
+    size_t nevents;
+    uint32_t narenas;
+    struct arena_trace_event *ev = read_trace( argv[optind], &nevents, &narenas, NULL );
+    if ( !ev ) {
+        return 1;
+    }
+    arena_init_arenas( narenas );
+    bool *created = calloc( narenas, sizeof *created );
+    if ( !created ) {
+        fprintf( stderr, "%s: out of memory\n", argv[0] );
+        free( ev );
+        return 1;
+    }
+
+    double elapsed = 0;
+    for ( size_t r = 0; r < repeat; ++r ) {
+        double start = now();
+        for ( size_t i = 0; i < nevents; ++i ) {
+            size_t n = ev[i].arena;
+            switch ( ev[i].type ) {
+            case ARENA_TRACE_CREATE:
+                if ( created[n] ) { // Created again without a destroy, the trace dropped it.
+                    arena_destroy( n );
+                }
+                arena_create_aligned( n, chunk_sz ? chunk_sz : ev[i].size,
+                                     align_set ? align : ev[i].aux ? ( size_t ) 1 << ev[i].aux : 0 );
+                created[n] = true;
+                break;
+            case ARENA_TRACE_ALLOC:
+            case ARENA_TRACE_CALLOC:
+                if ( !created[n] ) {
+                    arena_create_aligned( n, chunk_sz ? chunk_sz : 4096, align );
+                    created[n] = true;
+                }
+                if ( ev[i].type == ARENA_TRACE_ALLOC ) {
+                    arena_alloc( n, ev[i].size );
+                } else {
+                    arena_calloc( n, 1, ev[i].size );
+                }
+                break;
+            case ARENA_TRACE_DEALLOC:
+                if ( created[n] ) {
+                    arena_dealloc( n );
+                }
+                break;
+            case ARENA_TRACE_DESTROY:
+                if ( created[n] ) {
+                    arena_destroy( n );
+                    created[n] = false;
+                }
+                break;
+            }
+        }
+        elapsed += now() - start;
+        if ( r + 1 < repeat ) {
+            for ( size_t n = 0; n < narenas; ++n ) {
+                if ( created[n] ) {
+                    arena_destroy( n );
+                    created[n] = false;
+                }
+            }
+        }
+    }
+
+    struct arena_stats st;
+    arena_stats_global( &st );
+    printf( "events=%zu arenas=%u repeat=%zu chunk_sz=%zu align=%zu seconds=%.6f ns_per_event=%.2f "
+           "mallocs=%llu bytes_granted=%llu bytes_reserved=%zu lifetime_peak=%zu refills=%llu\n",
+           nevents, narenas, repeat, chunk_sz, align, elapsed,
+           nevents ? elapsed * 1e9 / ( ( double ) nevents * repeat ) : 0.0,
+           st.mallocs, st.bytes_granted, st.bytes_reserved, st.lifetime_peak, st.refills );
+    free( created );
+    free( ev );
+    return 0;
+}
@@ -0,0 +1,189 @@
+/**
+ * @file
+ * @brief Scaling of an allocation heavy workload over 1, 2, 4, ... threads, up to the number of
+ * cores, or -t threads. Every thread runs lifetimes of objects of random sizes, writing
+ * to each, in one of the modes:
+ *  arenas  An arena per thread, which needs no locking, as an arena is owned by a thread.
+ *  shared  One arena for all the threads, behind a mutex, with shared lifetimes: the
+ *          threads meet at a barrier at the end of each, and one of them deallocs.
+ *  malloc  malloc/free, freeing the objects of a lifetime one by one.
+ * The work per thread is fixed, so perfect scaling keeps the time flat. Every run is
+ * forked for its peak RSS, and the results are printed as CSV, with the scaling
+ * efficiency, the throughput over the threads times the throughput of one thread.
+ * Built by `make bench`.
+ * usage: scaling [-m arenas|shared|malloc|all] [-t max threads] [-l lifetimes] [-n objects]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "core_arena.h"
+#include "bench.h"
+
+enum mode { ARENAS, SHARED, MALLOC };
+static const char *mode_names[] = { "arenas", "shared", "malloc" };
+
+static enum mode mode;
+static size_t lifetimes = 200, objects = 10000;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t barrier;
+
+static void *worker( void *arg )
+{
+    size_t t = ( size_t ) arg;
+    uint64_t rng = 88172645463325252u + t;
+    void **ptrs = malloc( objects * sizeof *ptrs );
+    unsigned long sum = 0;
+    if ( !ptrs ) {
+        fprintf( stderr, "scaling: out of memory\n" );
+        exit( 1 );
+    }
+    for ( size_t l = 0; l < lifetimes; ++l ) {
+        for ( size_t i = 0; i < objects; ++i ) {
+            rng ^= rng << 13;
+            rng ^= rng >> 7;
+            rng ^= rng << 17;
+            size_t size = 8 + rng % 249;
+            char *p;
+            switch ( mode ) {
+            case ARENAS:
+                p = arena_alloc( t, size );
+                break;
+            case SHARED:
+                pthread_mutex_lock( &lock );
+                p = arena_alloc( 0, size );
+                pthread_mutex_unlock( &lock );
+                break;
+            default:
+                p = ptrs[i] = malloc( size );
+                break;
+            }
+            if ( !p ) {
+                fprintf( stderr, "scaling: out of memory\n" );
+                exit( 1 );
+            }
+            p[0] = ( char ) i;
+            p[size - 1] = ( char ) l;
+            sum += ( unsigned char ) p[0];
+        }
+        switch ( mode ) {
+        case ARENAS:
+            arena_dealloc( t );
+            break;
+        case SHARED:
+            if ( pthread_barrier_wait( &barrier ) == PTHREAD_BARRIER_SERIAL_THREAD ) {
+                arena_dealloc( 0 );
+            }
+            pthread_barrier_wait( &barrier );
+            break;
+        default:
+            for ( size_t i = 0; i < objects; ++i ) {
+                free( ptrs[i] );
+            }
+            break;
+        }
+    }
+    free( ptrs );
+    return ( void * ) sum;
+}
+
+struct result {
+    double seconds;
+    long peak_rss_kb;
+};
+
+/** Runs the workload on nthreads in a child, which sends the result back through a pipe. */
+static struct result run( size_t nthreads )
+{
+    struct result r = { -1, -1 };
+    int fds[2];
+    if ( pipe( fds ) ) {
+        perror( "pipe" );
+        exit( 1 );
+    }
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+        perror( "fork" );
+        exit( 1 );
+    }
+    if ( pid ) {
+        close( fds[1] );
+        if ( read( fds[0], &r, sizeof r ) != sizeof r ) {
+            fprintf( stderr, "scaling: %s with %zu threads failed\n", mode_names[mode], nthreads );
+        }
+        close( fds[0] );
+        waitpid( pid, NULL, 0 );
+        return r;
+    }
+    close( fds[0] );
+    pthread_t *threads = malloc( nthreads * sizeof *threads );
+    arena_init_arenas( nthreads );
+    for ( size_t t = 0; t < ( mode == ARENAS ? nthreads : 1 ); ++t ) {
+        arena_create( t, 4096 );
+    }
+    pthread_barrier_init( &barrier, NULL, ( unsigned ) nthreads );
+    uint64_t t0 = bench_ns();
+    for ( size_t t = 0; t < nthreads; ++t ) {
+        if ( pthread_create( &threads[t], NULL, worker, ( void * ) t ) ) {
+            perror( "pthread_create" );
+            exit( 1 );
+        }
+    }
+    for ( size_t t = 0; t < nthreads; ++t ) {
+        pthread_join( threads[t], NULL );
+    }
+    r.seconds = ( bench_ns() - t0 ) / 1e9;
+    r.peak_rss_kb = bench_peak_rss_kb();
+    if ( write( fds[1], &r, sizeof r ) != sizeof r ) {
+        exit( 1 );
+    }
+    exit( 0 );
+}
+
+int main( int argc, char *argv[] )
+{
+    static const char *usage = "usage: %s [-m arenas|shared|malloc|all] [-t max threads] [-l lifetimes] [-n objects]\n";
+    const char *which = "all";
+    long cores = sysconf( _SC_NPROCESSORS_ONLN );
+    size_t max_threads = cores > 0 ? ( size_t ) cores : 1;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "m:t:l:n:" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'm': which = optarg; break;
+        case 't': max_threads = strtoul( optarg, NULL, 10 ); break;
+        case 'l': lifetimes = strtoul( optarg, NULL, 10 ); break;
+        case 'n': objects = strtoul( optarg, NULL, 10 ); break;
+        default:
+            fprintf( stderr, usage, argv[0] );
+            return 2;
+        }
+    }
+    if ( !max_threads || !lifetimes || !objects ) {
+        fprintf( stderr, usage, argv[0] );
+        return 2;
+    }
+    bench_csv_header( "mode,threads,seconds,allocs,allocs_per_sec,efficiency,peak_rss_kb" );
+    for ( int m = ARENAS; m <= MALLOC; ++m ) {
+        if ( strcmp( which, "all" ) && strcmp( which, mode_names[m] ) ) {
+            continue;
+        }
+        mode = ( enum mode ) m;
+        double single = 0;
+        for ( size_t n = 1;; n = n * 2 < max_threads ? n * 2 : max_threads ) {
+            struct result r = run( n );
+            double allocs = ( double ) lifetimes * objects * n, rate = allocs / r.seconds;
+            if ( n == 1 ) {
+                single = rate;
+            }
+            bench_csv( "scaling,%s,%zu,%.6f,%.0f,%.0f,%.3f,%ld", mode_names[m], n, r.seconds, allocs, rate,
+                      rate / ( single * n ), r.peak_rss_kb );
+            if ( n == max_threads ) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,368 @@
+/**
+ * @file
+ * @brief What-if simulator for chunk sizes over an allocation trace recorded with
+ * arena_trace_start(). It runs the allocations of every arena through a model of the
+ * library and of glibc malloc, for every candidate chunk_sz, growth policy and alignment,
+ * without allocating anything, and recommends an arena_create configuration per arena.
+ * gcc -std=c99 -O2 -Isrc -o simulate bench/simulate.c bench/trace.c
+ * usage: simulate [-c chunk_sz,...] [-a align,...] [-s max slow path fraction] [-v] trace
+ * The default chunk sizes are the powers of two from 512 to 1M, plus the ones the trace
+ * created the arenas with, the default alignment is 0, an inline chunk header, and the
+ * default slow path fraction 0.01. -v prints the result of every candidate, not just the
+ * recommendation.
+ *
+ * The policies are:
+ *  fixed   New chunks are chunk_sz, or as large as the request, which is what the library
+ *          does, so only these are recommended.
+ *  double  Every new chunk is twice the size of the one before, up to 64 * chunk_sz, shown
+ *          for comparison, when it beats the recommendation.
+ *
+ * The recommendation is the configuration with the smallest peak footprint, among those
+ * that take the slow path for at most the slow path fraction of the requests, or the one
+ * with the fewest slow paths if none does. The footprint is what malloc reserves for the
+ * chunks, with glibc's rounding, and pages for chunks above its mmap threshold. The sizes
+ * of malloc's headers, the mmap threshold and the chunk header are the ones the library
+ * calibrated when the trace was recorded, from the header of the trace.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "core_arena.h"
+#include "trace.h"
+
+/** The parts of the library and glibc that the model must agree with, from the trace. */
+static struct arena_trace_header lib;
+static size_t ahs; /**< _AHS, the chunk header rounded up to MAX_ALIGN. */
+
+enum policy { FIXED, DOUBLE };
+static const char *policy_names[] = { "fixed", "double" };
+
+struct config {
+    size_t chunk_sz, align;
+    enum policy policy;
+};
+
+struct result {
+    struct config cfg;
+    bool valid;                        /**< chunk_sz is too small for the library. */
+    unsigned long long requests, slow, mallocs;
+    unsigned long long padding, tail;  /**< Over all lifetimes. */
+    size_t footprint, peak_footprint;  /**< Reserved by malloc, now and at most. */
+    size_t live, peak_live;            /**< Requested bytes, in this lifetime and at most. */
+};
+
+/** The chunks of a simulated arena, in the order of its chain. */
+struct sim {
+    size_t *payload, *reserved; /**< What the chunks hand out, and what malloc reserves for them. */
+    size_t nchunks, cap, cur, left, last, chunk_pd;
+};
+
+/** Whether glibc maps malloc(size) with mmap. */
+static bool mapped( size_t size )
+{
+    return size >= lib.mmap_threshold;
+}
+
+/** What glibc reserves for malloc(size). */
+static size_t reserved( size_t size )
+{
+    size_t got = ( size + lib.malloc_hdr + MAX_ALIGN - 1 ) & ~( size_t ) ( MAX_ALIGN - 1 );
+    if ( mapped( size ) ) {
+        size_t hdr = lib.mmap_hdr ? lib.mmap_hdr : 2 * lib.malloc_hdr;
+        return ( size + hdr + lib.page - 1 ) & ~( size_t ) ( lib.page - 1 );
+    }
+    return got < 2 * MAX_ALIGN ? 2 * MAX_ALIGN : got;
+}
+
+/** What malloc_usable_size() returns for malloc(size), which is what the library hands out. */
+static size_t usable( size_t size )
+{
+    return reserved( size ) - ( mapped( size ) ? 2 : 1 ) * lib.malloc_hdr;
+}
+
+static void sim_reset( struct sim *s )
+{
+    s->nchunks = s->cur = s->left = 0;
+}
+
+/** Appends a chunk of size bytes, as _chunk_new() does, returns false on out of memory. */
+static bool sim_chunk( struct sim *s, struct result *r, size_t size )
+{
+    if ( s->nchunks == s->cap ) {
+        size_t cap = s->cap ? 2 * s->cap : 16;
+        size_t *payload = realloc( s->payload, cap * sizeof *payload );
+        if ( !payload ) {
+            return false;
+        }
+        s->payload = payload;
+        size_t *res = realloc( s->reserved, cap * sizeof *res );
+        if ( !res ) {
+            return false;
+        }
+        s->reserved = res;
+        s->cap = cap;
+    }
+    size_t align = r->cfg.align;
+    s->payload[s->nchunks] = align ? usable( size ) : usable( size ) - ahs;
+    s->reserved[s->nchunks] = align ? reserved( size ) + reserved( lib.chunk_hdr ) : reserved( size );
+    r->footprint += s->reserved[s->nchunks];
+    if ( r->footprint > r->peak_footprint ) {
+        r->peak_footprint = r->footprint;
+    }
+    r->mallocs += 1; // Like the statistics, not counting the out of band header.
+    s->last = size;
+    s->nchunks++;
+    return true;
+}
+
+/** Creates the arena as _arena_init() does, returns false if the library would refuse. */
+static bool sim_create( struct sim *s, struct result *r )
+{
+    size_t chunk_sz = r->cfg.chunk_sz, align = r->cfg.align;
+    for ( size_t i = 0; i < s->nchunks; ++i ) {
+        r->footprint -= s->reserved[i];
+    }
+    sim_reset( s );
+    if ( chunk_sz < lib.malloc_hdr + MAX_ALIGN ) {
+        return false;
+    }
+    if ( align ) {
+        s->chunk_pd = ( chunk_sz + align - 1 ) & -align;
+    } else {
+        // As _chunk_request() does.
+        s->chunk_pd = lib.mmap_hdr && mapped( chunk_sz ) && chunk_sz >= lib.page
+                          ? ( chunk_sz & ~( size_t ) ( lib.page - 1 ) ) - lib.mmap_hdr
+                          : ( chunk_sz - lib.malloc_hdr ) & ~( size_t ) ( MAX_ALIGN - 1 );
+        if ( s->chunk_pd <= ahs ) {
+            return false;
+        }
+    }
+    if ( !sim_chunk( s, r, s->chunk_pd ) ) {
+        return false;
+    }
+    s->left = s->payload[0];
+    return true;
+}
+
+/** An allocation, with the fast path of arena_alloc() and the walk of _alloc(). */
+static bool sim_alloc( struct sim *s, struct result *r, size_t size )
+{
+    size_t mem_pd = ( size + MAX_ALIGN - 1 ) & ~( size_t ) ( MAX_ALIGN - 1 );
+    r->requests++;
+    r->padding += mem_pd - size;
+    r->live += mem_pd;
+    if ( r->live > r->peak_live ) {
+        r->peak_live = r->live;
+    }
+    if ( mem_pd <= s->left ) {
+        s->left -= mem_pd;
+        return true;
+    }
+    r->slow++;
+    r->tail += s->left;
+    size_t i;
+    for ( i = s->cur + 1; i < s->nchunks && s->payload[i] < mem_pd; ++i ) {
+        r->tail += s->payload[i];
+    }
+    if ( i == s->nchunks ) {
+        size_t align = r->cfg.align;
+        size_t size = align ? ( mem_pd + align - 1 ) & -align : mem_pd + ahs;
+        size_t want = s->chunk_pd;
+        if ( r->cfg.policy == DOUBLE && s->last * 2 <= 64 * s->chunk_pd ) {
+            want = s->last * 2;
+        }
+        if ( !sim_chunk( s, r, size > want ? size : want ) ) {
+            return false;
+        }
+    }
+    s->cur = i;
+    s->left = s->payload[i] - mem_pd;
+    return true;
+}
+
+static void sim_dealloc( struct sim *s, struct result *r )
+{
+    r->live = 0;
+    if ( s->nchunks ) {
+        s->cur = 0;
+        s->left = s->payload[0];
+    }
+}
+
+/** Runs the events of arena n through the model, created with r->cfg. */
+static void simulate( const struct arena_trace_event *ev, size_t nevents, uint32_t n,
+                     struct sim *s, struct result *r )
+{
+    struct config cfg = r->cfg;
+    memset( r, 0, sizeof *r );
+    r->cfg = cfg;
+    sim_reset( s );
+    bool created = false;
+    r->valid = true;
+    for ( size_t i = 0; i < nevents && r->valid; ++i ) {
+        if ( ev[i].arena != n ) {
+            continue;
+        }
+        switch ( ev[i].type ) {
+        case ARENA_TRACE_CREATE:
+            r->valid = created = sim_create( s, r );
+            break;
+        case ARENA_TRACE_ALLOC:
+        case ARENA_TRACE_CALLOC:
+            if ( !created ) {
+                r->valid = created = sim_create( s, r );
+            }
+            r->valid = r->valid && sim_alloc( s, r, ev[i].size );
+            break;
+        case ARENA_TRACE_DEALLOC:
+            sim_dealloc( s, r );
+            break;
+        case ARENA_TRACE_DESTROY:
+            for ( size_t c = 0; c < s->nchunks; ++c ) {
+                r->footprint -= s->reserved[c];
+            }
+            sim_reset( s );
+            created = false;
+            break;
+        }
+    }
+}
+
+/** Parses a comma separated list of sizes into list, returns their number. */
+static size_t parse_list( const char *arg, size_t *list, size_t max )
+{
+    size_t len = 0;
+    for ( char *end; *arg && len < max; arg = *end ? end + 1 : end ) {
+        list[len++] = strtoul( arg, &end, 10 );
+    }
+    return len;
+}
+
+static void print_result( uint32_t n, const char *what, const struct result *r )
+{
+    printf( "arena=%u %s policy=%s chunk_sz=%zu align=%zu requests=%llu mallocs=%llu "
+           "peak_footprint=%zu peak_live=%zu waste=%zu padding=%llu tail=%llu slow_path=%.4f\n",
+           n, what, policy_names[r->cfg.policy], r->cfg.chunk_sz, r->cfg.align, r->requests,
+           r->mallocs, r->peak_footprint, r->peak_live, r->peak_footprint - r->peak_live,
+           r->padding, r->tail, r->requests ? ( double ) r->slow / r->requests : 0.0 );
+}
+
+/** Whether a is a better configuration than b. */
+static bool better( const struct result *a, const struct result *b, double max_slow )
+{
+    bool a_ok = a->slow <= max_slow * a->requests, b_ok = b->slow <= max_slow * b->requests;
+    if ( a_ok != b_ok ) {
+        return a_ok;
+    }
+    if ( !a_ok && a->slow != b->slow ) {
+        return a->slow < b->slow;
+    }
+    if ( a->peak_footprint != b->peak_footprint ) {
+        return a->peak_footprint < b->peak_footprint;
+    }
+    return a->mallocs < b->mallocs;
+}
+
+int main( int argc, char *argv[] )
+{
+    static const char *usage = "usage: %s [-c chunk_sz,...] [-a align,...] [-s max slow path fraction] [-v] trace\n";
+    size_t sizes[64], nsizes = 0, aligns[16] = { 0 }, naligns = 1;
+    double max_slow = 0.01;
+    bool verbose = false;
+    int opt;
+    while ( ( opt = getopt( argc, argv, "c:a:s:v" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'c': nsizes = parse_list( optarg, sizes, 48 ); break;
+        case 'a': naligns = parse_list( optarg, aligns, 16 ); break;
+        case 's': max_slow = strtod( optarg, NULL ); break;
+        case 'v': verbose = true; break;
+        default:
+            fprintf( stderr, usage, argv[0] );
+            return 2;
+        }
+    }
+    if ( optind != argc - 1 ) {
+        fprintf( stderr, usage, argv[0] );
+        return 2;
+    }
+    for ( size_t i = 0; i < naligns; ++i ) {
+        if ( aligns[i] && ( aligns[i] < MAX_ALIGN || ( aligns[i] & ( aligns[i] - 1 ) ) ) ) {
+            fprintf( stderr, "%s: the alignment %zu is not a power of two >= %d\n", argv[0], aligns[i], MAX_ALIGN );
+            return 2;
+        }
+    }
+    if ( !nsizes ) {
+        for ( size_t sz = 512; sz <= 1024 * 1024; sz *= 2 ) {
+            sizes[nsizes++] = sz;
+        }
+    }
+
+    size_t nevents;
+    uint32_t narenas;
+    struct arena_trace_event *ev = read_trace( argv[optind], &nevents, &narenas, &lib );
+    if ( !ev ) {
+        return 1;
+    }
+    ahs = ( lib.chunk_hdr + MAX_ALIGN - 1 ) & ~( size_t ) ( MAX_ALIGN - 1 );
+
+    struct sim s = { 0 };
+    for ( uint32_t n = 0; n < narenas; ++n ) {
+        // The candidates are the chunk sizes asked for, plus the ones the trace used.
+        size_t cand[64], ncand = nsizes, traced = 0;
+        unsigned long long events = 0;
+        memcpy( cand, sizes, nsizes * sizeof *cand );
+        for ( size_t i = 0; i < nevents; ++i ) {
+            if ( ev[i].arena != n ) {
+                continue;
+            }
+            events++;
+            if ( ev[i].type == ARENA_TRACE_CREATE && !traced ) {
+                traced = ev[i].size;
+                size_t c;
+                for ( c = 0; c < ncand && cand[c] != traced; ++c )
+                    ;
+                if ( c == ncand ) {
+                    cand[ncand++] = traced;
+                }
+            }
+        }
+        if ( !events ) {
+            continue;
+        }
+
+        struct result best = { .valid = false }, best_double = { .valid = false }, r;
+        for ( size_t c = 0; c < ncand; ++c ) {
+            for ( size_t a = 0; a < naligns; ++a ) {
+                for ( int p = FIXED; p <= DOUBLE; ++p ) {
+                    r.cfg = ( struct config ) { cand[c], aligns[a], ( enum policy ) p };
+                    simulate( ev, nevents, n, &s, &r );
+                    if ( !r.valid ) {
+                        continue;
+                    }
+                    if ( verbose ) {
+                        print_result( n, cand[c] == traced ? "traced" : "candidate", &r );
+                    }
+                    struct result *b = p == FIXED ? &best : &best_double;
+                    if ( !b->valid || better( &r, b, max_slow ) ) {
+                        *b = r;
+                    }
+                }
+            }
+        }
+        if ( !best.valid ) {
+            printf( "arena=%u no candidate chunk_sz is large enough\n", n );
+            continue;
+        }
+        print_result( n, "recommended", &best );
+        if ( best_double.valid && better( &best_double, &best, max_slow ) ) {
+            print_result( n, "with_growth", &best_double );
+        }
+        printf( "arena=%u arena_create_aligned(%u, %zu, %zu);\n", n, n, best.cfg.chunk_sz, best.cfg.align );
+    }
+    free( s.payload );
+    free( s.reserved );
+    free( ev );
+    return 0;
+}
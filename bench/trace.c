@@ -0,0 +1,64 @@
+/**
+ * @file
+ * @brief Reading of the allocation traces recorded with arena_trace_start().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+/** The rings of the threads are written as they fill up, so put the events in time order. */
+static int by_time( const void *a, const void *b )
+{
+    const struct arena_trace_event *x = a, *y = b;
+    return x->ts < y->ts ? -1 : x->ts > y->ts;
+}
+
+struct arena_trace_event *read_trace( const char *path, size_t *nevents, uint32_t *narenas,
+                                     struct arena_trace_header *hdr_out )
+{
+    FILE *fp = fopen( path, "rb" );
+    if ( !fp ) {
+        perror( path );
+        return NULL;
+    }
+    struct arena_trace_header hdr;
+    if ( fread( &hdr, sizeof hdr, 1, fp ) != 1 || memcmp( hdr.magic, ARENA_TRACE_MAGIC, sizeof hdr.magic )
+        || hdr.version != ARENA_TRACE_VERSION ) {
+        fprintf( stderr, "%s: not a trace file\n", path );
+        fclose( fp );
+        return NULL;
+    }
+    size_t cap = 1 << 16, len = 0;
+    struct arena_trace_event *ev = malloc( cap * sizeof *ev );
+    while ( ev ) {
+        len += fread( ev + len, sizeof *ev, cap - len, fp );
+        if ( len < cap ) {
+            break;
+        }
+        cap *= 2;
+        struct arena_trace_event *grown = realloc( ev, cap * sizeof *ev );
+        if ( !grown ) {
+            free( ev );
+            ev = NULL;
+        }
+        ev = grown;
+    }
+    fclose( fp );
+    if ( !ev ) {
+        fprintf( stderr, "%s: out of memory\n", path );
+        return NULL;
+    }
+    *narenas = hdr.arenas;
+    if ( hdr_out ) {
+        *hdr_out = hdr;
+    }
+    for ( size_t i = 0; i < len; ++i ) {
+        if ( ev[i].arena >= *narenas ) {
+            *narenas = ev[i].arena + 1;
+        }
+    }
+    qsort( ev, len, sizeof *ev, by_time );
+    *nevents = len;
+    return ev;
+}
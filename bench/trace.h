@@ -0,0 +1,21 @@
+/**
+ * @file
+ * @brief Reading of the allocation traces recorded with arena_trace_start(), shared by the tools
+ * in bench/ that work on traces.
+ */
+#ifndef BENCH_TRACE_H
+#define BENCH_TRACE_H
+#include <stddef.h>
+#include <stdint.h>
+#include "core_arena.h"
+
+/**
+ * Reads the events of the trace file path in time order, returns NULL, after saying why
+ * on stderr, if it can't. narenas is set to one more than the highest arena in the trace,
+ * or to the number of arenas when it was recorded if that is larger, and hdr to the header
+ * of the trace, if it isn't NULL.
+ */
+struct arena_trace_event *read_trace( const char *path, size_t *nevents, uint32_t *narenas,
+                                     struct arena_trace_header *hdr );
+
+#endif
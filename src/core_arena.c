@@ -1,5 +1,5 @@
 
-#define CORE_ARENA_NO_LOGGING 
+#define _POSIX_C_SOURCE 200809L /* posix_memalign() */
 
 /**
  * @file
@@ -108,38 +108,223 @@
     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA. */
 
 #include "core_arena.h"
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 /**
  * @defgroup InternalVars  Internal datastructure and variables.
  * @{
  */
 
-static const ptrdiff_t _128K = 128 * 1024 ; /**< constant for 128K, which is max malloc can allocate from core. */
 /** Typedef of struct arena */
 typedef struct arena Arena;
-/** Our struct for book keeping of the arena and its storage . */
+/**
+ * Our struct for book keeping of a chunk.
+ * @details
+ * With the default layout it lives at the start of every chunk, and the memory we hand
+ * out starts _AHS bytes into the chunk. Arenas created with arena_create_aligned() keep it
+ * out of band, in a malloc'ed record of its own, so the memory we hand out starts right
+ * at the aligned start of the chunk.
+ */
 struct arena {
-    struct arena *next; /**< Link to next arena, one arena can consist of manyy arenas backed by individual buffers. */
-    size_t chunk_sz;    /**< The size of the buffer allocated internally to satisfy memory requests from. */
-    char *begin; /**< Next available location in the internal buffer to allocate memory from. */
-    /** Address of one past end of buffer. */
-    // *INDENT-OFF*
-    char __attribute__((aligned(MAX_ALIGN))) *end; 
-    // *INDENT-ON*
+    struct arena *next; /**< Link to next chunk, one arena can consist of many chunks backed by individual buffers. */
+    char *base;         /**< The first byte of the chunk we can hand out. */
+    char *end;          /**< Address of one past end of buffer. */
+    size_t chunk_sz;    /**< The number of bytes we asked malloc for, larger than the arena's for one-offs. */
+};
+
+/**
+ * The file of an arena made by arena_create_mapped().
+ * @details
+ * The whole reserve is mapped from the file at once, and the file grows under the mapping,
+ * so the chunks are contiguous, and the offsets of the objects in them are the same every
+ * time the file is mapped. The header at the start of the file records the chunk chain.
+ */
+struct mapping {
+    char *base;                    /**< Where the file is mapped, the header is here. */
+    struct arena_file_header *hdr; /**< The header, at base. */
+    size_t size;                   /**< The bytes of the file in use, the header and the chunks. */
+    size_t adopted;                /**< The chunks of the table that have an Arena record. */
+    int fd;                        /**< The file. */
+    int sync;                      /**< The ARENA_SYNC_* mode for the chunks we move on from. */
+};
+
+/** A chunk as the last checkpoint of its arena has it. */
+struct ckpt_chunk {
+    char *base;      /**< The chunk at this place in the chain. */
+    uint64_t size;   /**< The bytes of it in the image. */
+    uint64_t gen;    /**< The checkpoint that wrote it last, which names its file. */
+    uint64_t offset; /**< Where it is in that file. */
+    bool dirty;      /**< Written in place since, see arena_mark_dirty(). */
+};
+
+/**
+ * What arena_checkpoint() knows of the checkpoints of an arena.
+ * @details
+ * A chunk is written again when it isn't at the same place in the chain with the same
+ * size as at the last checkpoint, when a lifetime has ended since, when it is marked
+ * dirty, or when the soft dirty bits say a page of it has been written.
+ */
+struct checkpoint {
+    char *dir;                    /**< The directory of the checkpoints, NULL before one. */
+    uint64_t seq;                 /**< The last checkpoint. */
+    unsigned long long lifetimes; /**< The lifetimes of the arena at it. */
+    struct ckpt_chunk *chunk;     /**< The chunks at it. */
+    size_t chunks;
+    uint64_t *stale;              /**< The chunk files of a manifest found in dir, to unlink. */
+    size_t nstale;
+    int pagemap;                  /**< /proc/self/pagemap for the soft dirty bits, or -1. */
+    bool full;                    /**< The next checkpoint writes every chunk. */
 };
 
+/** Typedef of struct arena_desc */
+typedef struct arena_desc ArenaDesc;
+/**
+ * The descriptor of an arena.
+ * @details
+ * Everything the fast path in arena_alloc() needs is kept in the first cache line, so that
+ * serving a request touches that line and the memory handed out, and nothing else. The
+ * rest is only used by _alloc() when the current chunk needs a refill, and by the other
+ * functions. The chunk headers are only visited on a refill. The descriptors are padded
+ * to a cache line so arenas used by different threads don't false share.
+ *
+ * The counters are plain, the descriptor is owned by whoever allocates from the arena.
+ * They count from arena_create(), and are kept after arena_destroy() so they can be
+ * reported.
+ */
+struct arena_desc {
+    char *begin;         /**< Next available location in the current chunk. */
+    char *end;           /**< Address of one past end of the current chunk. */
+    unsigned long long requests;        /**< The number of requests served. */
+    unsigned long long bytes_allocated; /**< Bytes requested and handed out. */
+    unsigned long long bytes_padding;   /**< Bytes added to the requests for MAX_ALIGN. */
+    size_t min_request;  /**< The smallest request. */
+    size_t max_request;  /**< The largest request. */
+    struct arena_histogram *hist; /**< The histograms, NULL when not collected. */
+   // End of the first cache line.
+    Arena *cur;          /**< The chunk we are currently allocating from. */
+    Arena *head;         /**< The first chunk, NULL when not created, or a budget held it back. */
+    size_t chunk_sz;     /**< The bytes to ask malloc for for new chunks. 0 when not created. */
+    size_t align;        /**< Alignment of the chunks with out of band headers, 0 for the default layout. */
+    size_t mem_malloced; /**< Bytes in chunks that malloc serves from the heap. */
+    size_t mem_mmapped;  /**< Bytes in chunks that malloc serves with mmap. */
+    size_t chunks;       /**< The number of chunks in the chain. */
+    size_t max_chunk_size; /**< The largest chunk malloc has given us. */
+    size_t bytes_oversized;  /**< Bytes in chunks made for more than chunk_sz. */
+    size_t oversized_chunks; /**< The number of chunks made for more than chunk_sz. */
+    unsigned long long bytes_tail;    /**< Bytes left behind in chunks we moved on from. */
+    unsigned long long refills;       /**< The number of times _alloc() refilled the descriptor. */
+    unsigned long long mallocs;       /**< The number of chunks malloc'ed. */
+    unsigned long long bytes_granted; /**< The bytes of all the chunks malloc'ed. */
+    unsigned long long lifetimes;     /**< The number of arena_dealloc() calls. */
+    unsigned long long lifetime_mark; /**< bytes_allocated + bytes_padding at start of lifetime. */
+    unsigned long long padding_mark;  /**< bytes_padding at start of lifetime. */
+    unsigned long long tail_mark;     /**< bytes_tail at start of lifetime. */
+    size_t lifetime_peak;             /**< The most bytes handed out during a lifetime. */
+    size_t peak_padding;              /**< Bytes lost to padding in the lifetime of the peak. */
+    size_t peak_tail;                 /**< Bytes lost to tails in the lifetime of the peak. */
+    unsigned long long refill_mark;   /**< refills at start of lifetime. */
+    size_t adapt_min;    /**< The smallest chunk_sz the arena adapts to, 0 when not adaptive. */
+    size_t adapt_max;    /**< The largest chunk_sz the arena adapts to. */
+    size_t adapt_want;   /**< The decaying lifetime peak the adaptive chunk_sz is sized for. */
+    unsigned trim_mark;  /**< The trim_epoch the arena has trimmed for. */
+    unsigned char state; /**< DESC_ACTIVE, DESC_PARKED or DESC_TRIMMING, atomic. */
+    bool budget_fired;   /**< budget_fn has been called, until the arena is under budget_soft. */
+    size_t budget_soft;  /**< The bytes reserved above which budget_fn is called, 0 for none. */
+    size_t budget_hard;  /**< The bytes reserved above which requests fail, 0 for none. */
+    arena_budget_fn budget_fn; /**< Called when the soft budget is crossed, or NULL. */
+    void *budget_ctx;    /**< Passed to budget_fn. */
+    struct mapping *map; /**< The file of a mapped arena, NULL for chunks from malloc. */
+    struct checkpoint *ckpt; /**< What the last arena_checkpoint() wrote, NULL before it. */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
 static uint_32 ARENAS_MAX;
-static Arena *first; /**< A head pointer to the first arena */
-static Arena **arenas; /**< Backing Array for accessing and using arenas */
-static size_t *arena_chunk_sz; /**< Standard chunk_siz for arena. */
+static ArenaDesc *descs; /**< Backing Array for the descriptors of the arenas. */
+/** Bumped under memory pressure, the arenas trim their retained chunks at the next
+ * arena_dealloc() when it has changed, see arena_pressure_start(). */
+static unsigned trim_epoch;
+
+/** The owner of the arena is in a lifetime, or in a call that walks its chunks. */
+#define DESC_ACTIVE 0
+/** The owner is between lifetimes, so the pressure thread may trim the arena. */
+#define DESC_PARKED 1
+/** The pressure thread is trimming the arena. */
+#define DESC_TRIMMING 2
 
-/** error message string for an out of range arena numberer. */
-static const char *msgBadArena = "Bad arena %lu: max arena: %d see ARENAS_MAX in core_arena.h\n";
+/**
+ * @brief Takes an arena back from the pressure thread, before its owner walks or changes
+ * its chunks outside the fast path.
+ * @details
+ * Only the owner makes an arena active or parked, so an active one costs a plain load. A
+ * trim in progress is waited for, it frees a few chunks.
+ * @return Whether it was parked, for _desc_park() after calls that don't start a lifetime.
+ */
+static inline bool _desc_claim( ArenaDesc *a )
+{
+    if ( __atomic_load_n( &a->state, __ATOMIC_RELAXED ) == DESC_ACTIVE ) {
+        return false;
+    }
+    for ( ;; ) {
+        unsigned char st = DESC_PARKED;
+        if ( __atomic_compare_exchange_n( &a->state, &st, DESC_ACTIVE, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE ) ) {
+            return true;
+        }
+        sched_yield(  );
+    }
+}
 
-const ptrdiff_t _AHS = sizeof( Arena ); /**< Arena Header Size */
+/** Hands an arena its owner is done with for now to the pressure thread. */
+static inline void _desc_park( ArenaDesc *a )
+{
+    __atomic_store_n( &a->state, DESC_PARKED, __ATOMIC_RELEASE );
+}
 
-/** Simple MAX macro, since no sideeffects */
-#define MAX(a,b) a > b ? a : b;
+/** error message string for an out of range arena numberer. */
+static const char *msgBadArena = "Bad arena %lu: max arena: %d see ARENAS_MAX in core_arena.h\n";
+/** error message string for using an arena that isn't created. */
+static const char *msgNoArena = "Arena %lu is used before arena_create() or after arena_destroy().\n";
+
+/** Arena Header Size, rounded up so the memory after an inline header is MAX_ALIGN'ed. */
+const ptrdiff_t _AHS = ( sizeof( Arena ) + MAX_ALIGN - 1 ) & ~( MAX_ALIGN - 1 );
+
+/** The bytes malloc keeps in front of a block, MALLOC_PTR_SIZE until we have asked malloc. */
+static ptrdiff_t malloc_hdr_sz = MALLOC_PTR_SIZE;
+
+/** The size from which malloc serves a block with mmap. glibc starts at 128K, and raises it
+ * when a mapped block is freed, so it follows the chunks we get, unless it is pinned. */
+static size_t mmap_threshold = 128 * 1024;
+/** Whether mmap_threshold is pinned with mallopt(), by arena_set_mmap_threshold(). */
+static bool mmap_threshold_pinned;
+/** What a request must leave of the pages malloc maps for it, for the mapping to be just
+ * those pages, 0 when it isn't known, and the chunks aren't rounded to pages. */
+static ptrdiff_t mmap_hdr_sz;
+/** The page size, for the rounding of mapped chunks. */
+static size_t page_sz = 4096;
+
+/** Simple MAX macro, evaluates the larger argument twice, so no side effects. */
+#define MAX(a,b) ( (a) > (b) ? (a) : (b) )
+
+/** The number of bytes malloc really reserved for the block at p, we asked for size. */
+static inline size_t _usable_size( void *p, size_t size )
+{
+#ifdef __GLIBC__
+    (void) size;
+    return malloc_usable_size( p );
+#else
+    (void) p;
+    return size;
+#endif
+}
 
 /** @} */
 
@@ -258,15 +443,42 @@ static inline void _logmsg_write( const char *format, ... )
     errno = savedErrno;
 }
 
+/** Writes all of buf to fd, async-signal-safe. */
+static void _write_all( int fd, const char *buf, size_t len )
+{
+    while ( len ) {
+        ssize_t w = write( fd, buf, len );
+        if ( w < 0 && errno == EINTR ) {
+            continue;
+        } else if ( w <= 0 ) {
+            return;
+        }
+        buf += w;
+        len -= ( size_t ) w;
+    }
+}
+
 /** @} */
-static size_t  tot_mem_usage; /**>Total usage in bytes. */
-static size_t  *arenas_mem_malloced ; 
-static size_t *arenas_mem_mmapped ; 
+/** Total usage in bytes, shared by the arenas, so it is updated atomically, as arenas may
+ * be used from different threads. */
+static size_t  tot_mem_usage;
 /**
  * @defgroup InspectMemFree Utility for finding free meory.
  *
  */
 size_t ARENAS_MAX_ALLOC;
+/** The cap set by arena_set_max_alloc() or CORE_ARENA_MAX_ALLOC, 0 when it is found. */
+static size_t max_alloc_override;
+/** inotify descriptor watching the memory limit of our cgroup, -1 when not watched. */
+static int cgroup_watch = -1;
+/** When cgroup_watch was last read, CLOCK_MONOTONIC_COARSE in nanoseconds, atomic. */
+static uint64_t cgroup_checked;
+
+/** ARENAS_MAX_ALLOC, which may be changed by another thread when the cgroup limit does. */
+static inline size_t _max_alloc( void )
+{
+    return __atomic_load_n( &ARENAS_MAX_ALLOC, __ATOMIC_RELAXED );
+}
 
 static inline size_t ram_avail(void )
 {
@@ -288,447 +500,2671 @@ static inline size_t ram_avail(void )
 }
 
 /**
- * @defgroup LoggingSystem Simple logging system.
- * @brief A small logging system that reports memory usage by the arenas at program exit.
- * @details We support logging, so you can deduce the memory usage, the logging is only
- * intended for testing, and not to be left on in production code. The logging report is
- * bypassed if you exit your program with `_Exit` or a `TERM` signal, as
- * the report_usage is installed by `atexit()`.
+ * @defgroup Histograms Histograms of request sizes and lifetime peaks.
+ * @details
+ * The request sizes are counted in log2 buckets. The lifetime peaks are counted HDR style,
+ * every power of two is split into 2^ARENA_HIST_SUB_BITS linear buckets, so a bucket is
+ * never wider than 1/2^ARENA_HIST_SUB_BITS of the values in it.
  * @{
  */
-/** Constant for no logging */
-#define NO_ARENA_LOGGING 0
-/** Constant for logging allocations of memory for the arenas. */
-#define LOG_CHUNK_MALLOCS 1
-/** Constant for logging bothh allocations of memory *for* the arenas, and the allocations
- * of memory *from* the arenas. */
-#define FULL_ARENA_LOGGING 2
-
-#define ARENAS_LOG_LEVEL 1
-
-#if ARENAS_LOG_LEVEL ==  1
-
-#ifndef CORE_ARENA_NO_LOGGING
-static unsigned long long allocated_chunks[ARENAS_MAX];
-static unsigned long long allocation_chunk_count[ARENAS_MAX];
-#endif
-#elif ARENAS_LOG_LEVEL == 2
 
-static unsigned long long allocated_chunks[ARENAS_MAX];
-static unsigned long long allocation_chunk_count[ARENAS_MAX];
-static unsigned long long allocated_memory[ARENAS_MAX];
-static unsigned long long allocation_memory_count[ARENAS_MAX];
+/** The log2 bucket of a request size, sizes are never 0. */
+static inline unsigned _hist_size_index( size_t v )
+{
+    return 63 - __builtin_clzll( ( unsigned long long ) v );
+}
 
-#endif
+/** The bucket of a lifetime peak in the sketch. */
+static inline unsigned _hist_peak_index( size_t v )
+{
+    if ( v < ( 1u << ARENA_HIST_SUB_BITS ) ) {
+        return ( unsigned ) v;
+    }
+    unsigned e = 63 - __builtin_clzll( ( unsigned long long ) v );
+    unsigned sub = ( unsigned ) ( v >> ( e - ARENA_HIST_SUB_BITS ) ) & ( ( 1u << ARENA_HIST_SUB_BITS ) - 1 );
+    return ( ( e - ARENA_HIST_SUB_BITS + 1 ) << ARENA_HIST_SUB_BITS ) + sub;
+}
 
+/** The smallest lifetime peak that is counted in bucket i of the sketch. */
+static inline size_t _hist_peak_floor( unsigned i )
+{
+    if ( i < ( 1u << ARENA_HIST_SUB_BITS ) ) {
+        return i;
+    }
+    unsigned e = ( i >> ARENA_HIST_SUB_BITS ) + ARENA_HIST_SUB_BITS - 1;
+    size_t sub = i & ( ( 1u << ARENA_HIST_SUB_BITS ) - 1 );
+    return ( ( size_t ) 1 << e ) + ( sub << ( e - ARENA_HIST_SUB_BITS ) );
+}
 
 /**
- * @brief Reports memory usage, installed by atexit().
+ * @brief Prints the bytes lost to padding, tails and one-off oversized chunks.
+ * @details
+ * The padding and tails are those of the lifetime of the peak, so they are part of the
+ * memory the arena needed at the most, and are given as a percentage of the memory malloc
+ * has reserved for the arena, like the oversized chunks that are retained.
  */
-#if ARENAS_LOG_LEVEL > 0
-void report_memory_usage( void )
+void arena_report_waste( FILE *fp )
 {
-#if ARENAS_LOG_LEVEL ==  0
-    ;
-#elif ARENAS_LOG_LEVEL ==  1
-#ifndef CORE_ARENA_NO_LOGGING
-    fprintf( stderr, "\nReport of arena memory usage:\n" "=============================\n" );
-    for ( int i = 0; i < ARENAS_MAX; ++i ) {
-        fprintf( stderr, "Arena nr %i was granted %llu bytes of memory in %llu allocations.\n",
-                 i, allocated_chunks[i], allocation_chunk_count[i] );
-    }
-#endif
-#elif ARENAS_LOG_LEVEL == 2
-    fprintf( stderr, "\nReport of arena memory usage:\n" "=============================\n" );
-    for ( int i = 0; i < ARENAS_MAX; ++i ) {
-        fprintf( stderr, "Arena nr %i was granted %llu bytes of memory in %llu allocations.\n",
-                 i, allocated_chunks[i], allocation_chunk_count[i] );
-        fprintf( stderr, "Arena nr %i  gave away  %llu bytes of memory in %llu serves.\n",
-                 i, allocated_memory[i], allocation_memory_count[i] );
+    fprintf( fp, "Arena waste at the lifetime peak, in bytes and %% of the reserved bytes:\n" );
+    for ( uint_32 i = 0; i < ARENAS_MAX; ++i ) {
+        struct arena_stats st;
+        arena_stats( i, &st );
+        if ( !st.requests && !st.bytes_reserved ) {
+            continue;
+        }
+        double pct = st.bytes_reserved ? 100.0 / ( double ) st.bytes_reserved : 0.0;
+        fprintf( fp, "Arena nr %u reserved %zu, padding %zu (%.1f%%), tails %zu (%.1f%%), "
+                 "oversized %zu in %zu chunks (%.1f%%)\n", i, st.bytes_reserved,
+                 st.peak_padding, st.peak_padding * pct, st.peak_tail, st.peak_tail * pct,
+                 st.bytes_oversized, st.oversized_chunks, st.bytes_oversized * pct );
     }
-#endif
+}
 
+/**
+ * @brief Prints the histograms of the arenas that collect them.
+ */
+static void _report_histograms( FILE *fp )
+{
+    for ( uint_32 i = 0; i < ARENAS_MAX; ++i ) {
+        struct arena_histogram *h = descs[i].hist;
+        if ( !h ) {
+            continue;
+        }
+        fprintf( fp, "Arena nr %u request sizes:\n", i );
+        for ( unsigned b = 0; b < ARENA_HIST_SIZES; ++b ) {
+            if ( h->sizes[b] ) {
+                fprintf( fp, "  [%zu, %zu): %llu\n", ( size_t ) 1 << b,
+                         b < 63 ? ( size_t ) 1 << ( b + 1 ) : SIZE_MAX, h->sizes[b] );
+            }
+        }
+        fprintf( fp, "Arena nr %u lifetime peaks: p50 %zu p90 %zu p99 %zu max %zu\n", i,
+                 arena_hist_peak_quantile( h, 0.5 ), arena_hist_peak_quantile( h, 0.9 ),
+                 arena_hist_peak_quantile( h, 0.99 ), arena_hist_peak_quantile( h, 1.0 ) );
+    }
 }
-#endif
 
 /** @} */
+
 /**
- * @defgroup InternalFuncs Internal functions. 
+ * @defgroup LoggingSystem Simple logging system.
+ * @brief A small logging system that reports memory usage by the arenas at program exit.
+ * @details
+ * The level is set at runtime, with arena_set_log_level() or the environment variable
+ * CORE_ARENA_LOG_LEVEL, which is read by arena_init_arenas(). The counters reported are
+ * those of arena_stats(), which are always kept, so the level only decides what is
+ * written, and it is only looked at outside the fast path of arena_alloc(). The report is
+ * bypassed if you exit your program with `_Exit` or a `TERM` signal, as the
+ * report_memory_usage is installed by `atexit()`.
  * @{
  */
 
+static int arena_log_level = NO_ARENA_LOGGING; /**< The current logging level. */
+
 /**
- * @brief
- * Initializes an arena and configures it with the effective chunk_size, and allocates the
- * memory, with malloc().
- * @param n The arena numberer we arena initializing.
- * @param chunk_sz  MALLOC_PTR_SIZE bytes larger than effective chunk size in bytes.
- * @details
- * We consider how malloc operates carefully to optimize block sizes and thereby improves
- * efficiency of the heap.
- * * The  amount of memory that malloc needs to store a pointer in the block is subtracted
- * from the requested memory.
- * * We do this, so that it is easy to use block sizes the size of page size (4096), whole
- * multiples of that, or whole parts of that, (2048, 1024, 512, 256, 128, 64.). This makes
- * it faster to allocate blocks, and if malloc needs to split blocks delivered from the
- * heap, then the heap is kept as tidy as  posible.
- * * I recommend the smallest chunk_sz requested to be 1024 bytes.
+ * @brief Sets the logging level.
+ * @param level NO_ARENA_LOGGING, LOG_CHUNK_MALLOCS or FULL_ARENA_LOGGING.
  */
-static const char *alloc_emsg = "%s: The chunk_sz requested is to small: %d\n";
-static const char *alloc_emsg2 = "%s: The chunk_sz: %lu requested is too large.\n"
-                           "The request is larger than ARENAS_MAX_ALLOC %lu: ";
-static const char *alloc_emsg3 = "%s: The chunk_sz: %lu requested is too large.\n"
-                           "It will make the total number of bytes requested larger than ARENAS_MAX_ALLOC %lu: ";
-static Arena *_arena_init( size_t n, size_t chunk_sz )
+void arena_set_log_level( int level )
 {
-    ptrdiff_t chunk_pd = chunk_sz; // maybe someone without gcc wants to compile it.
-
-    if ( chunk_pd <  MALLOC_PTR_SIZE + MAX_ALIGN ) {
-        fprintf( stderr, alloc_emsg, chunk_sz );
-        abort(  );
-    }
-    chunk_pd -= MALLOC_PTR_SIZE;
-    /// @todo: Not sure about this at all. But it is to be able to really get pages
-    // the size of 1024, but I think malloc will add 8 to 1024.
-    // so for instance the smart size to ask for is 4096-8 == 4088. 
-
-   // the size of the pointer malloc uses to address the allocated block.
-    ptrdiff_t padding = -chunk_pd & ( MAX_ALIGN - 1 );
-
-    if ( padding ) {
-        chunk_pd -= ( MAX_ALIGN - padding ); // Guaranteed to be positive.
+    if ( level < NO_ARENA_LOGGING ) {
+        level = NO_ARENA_LOGGING;
+    } else if ( level > FULL_ARENA_LOGGING ) {
+        level = FULL_ARENA_LOGGING;
     }
+    arena_log_level = level;
+}
 
-    if ( chunk_pd <= ( ptrdiff_t ) _AHS ) {
-        fprintf( stderr, alloc_emsg,"_arena_init", ( chunk_pd + padding + MALLOC_PTR_SIZE ) );
-        /// @todo: MALLOC_PTR_SIZE -> MALLOC_BLOCKSZ_FIELD.
-        abort(  );
-    }
+/**
+ * @brief Gets the logging level.
+ */
+int arena_get_log_level( void )
+{
+    return arena_log_level;
+}
 
-    if ( chunk_pd > (ssize_t) (ARENAS_MAX_ALLOC - MALLOC_PTR_SIZE) ) {
-        fprintf( stderr, alloc_emsg2, "_arena_init", chunk_pd, ARENAS_MAX_ALLOC );
-        abort(  );
-    } else if ( tot_mem_usage > ARENAS_MAX_ALLOC - (chunk_pd + MALLOC_PTR_SIZE) ) {
-        fprintf( stderr, alloc_emsg3, "_arena_init",chunk_pd, ARENAS_MAX_ALLOC );
-        abort(  );
+/**
+ * @brief Sets the logging level from CORE_ARENA_LOG_LEVEL, if it is set.
+ * @details
+ * The level is either a number, or one of the README's names: NONE, CHUNKS or EVERYTHING.
+ */
+static void _log_level_from_env( void )
+{
+    const char *env = getenv( "CORE_ARENA_LOG_LEVEL" );
+    if ( !env || !*env ) {
+        return;
     }
-
-    Arena *p;
-    p = malloc( chunk_pd );
-    if ( !p ) {
-        return NULL;
-    } 
-    tot_mem_usage += chunk_pd ; // updates total allocated.
-    if ( chunk_pd < _128K ) {
-        arenas_mem_malloced[n] += chunk_pd ;
+    if ( !strcmp( env, "NONE" ) ) {
+        arena_set_log_level( NO_ARENA_LOGGING );
+    } else if ( !strcmp( env, "CHUNKS" ) ) {
+        arena_set_log_level( LOG_CHUNK_MALLOCS );
+    } else if ( !strcmp( env, "EVERYTHING" ) ) {
+        arena_set_log_level( FULL_ARENA_LOGGING );
     } else {
-        arenas_mem_mmapped[n] += chunk_pd ;
+        arena_set_log_level( atoi( env ) );
     }
-    p->chunk_sz = chunk_pd;
-    p->begin = ( char * ) p + _AHS;
-    p->end = ( char * ) p + chunk_pd; // real_size;
-    p->next = NULL;
-   // see https://nullprogram.com/blog/2023/09/27/ (the alloca() function //
-    return p;
 }
 
 /**
- * @brief Allocates memory from an arena a new arena if necessary for delivering the
- * request..
- * @param **p The arena to request memory from, can change if needs new arena.
- * @param mem_sz The amount of memory requested.
- * @param n The arena number so we can log allocations to it, and identify configured
- * chunk_sz.
- * @detail
- * This is basically Hanson's work.
- * This scheme is like it is so that it can work after a deallocation of the areas too,
- * reusing the previously not freed memory.
- * Algorithm taken from Hanson p. 3 where it is described, but with padding method from
- * Wellons, in addition I have added a "fail-safe" for when the ask for memory is larger
- * than then chunk_sz the arena is currently configured for, so that it will then as a
- * "one-off" case allocate a sufficiently large block.
- * 23-12-27: Now this is basically u/skeetos work for I have followed most of his 
- * recommendations in hardening the function.
+ * @brief Reports memory usage, installed by atexit().
+ * @details
+ * With LOG_CHUNK_MALLOCS the chunks malloc'ed for each arena are reported, with
+ * FULL_ARENA_LOGGING the memory handed out, and the waste, too.
  */
-static void *_alloc( Arena ** p, size_t mem_sz, size_t n )
+void report_memory_usage( void )
 {
-   // First reject anything nonsensical or excessively large .
-    if ( mem_sz == 0 || mem_sz > PTRDIFF_MAX ) {
-        return NULL; // request impossibly large (out of memory)
+    if ( arena_log_level == NO_ARENA_LOGGING ) {
+        return;
     }
-   // Convert to signed so that it does not implicitly cast expression 
-   // using it to size_t later. After this mem_sz is no longer needed.
-    ptrdiff_t mem_pd = mem_sz;
-   // Padding will be a small non-negative number. It is always safe
-   // to subtract from a size, as the result will at worst be a small
-   // negative number.
-    ptrdiff_t padding = -mem_pd & ( MAX_ALIGN - 1 );
-
-    // Size calculations differ here from _arena_init
-    // We want a chunk of memory from a l
-
-
-    Arena *ap;
-    for ( ap = *p;; *p = ap ) {
-       // Work using a size, not with pointer arithmetic.
-        ptrdiff_t available = ap->end - ap->begin; 
-        // assert(available >= 0 );
-
-       // Per the note, this subtraction is safe. Both operands are
-       // signed, so no surprise promotions turning a small negative
-       // into large positive (i.e. size_t).
-        if ( mem_pd > available - padding ) {
-            if ( ap->next ) {
-                ap = ap->next;
-                ap->begin = ( char * ) ap + _AHS; // reset!
-                // ap->end is never touched!
-                continue; // keep looking
-
-            } else { // End of the list, allocate a new chunk.
-               // It is *not* yet safe to add header_size to mem_pd,
-               // so subtract from the other side.¸
-                if ( mem_pd > (PTRDIFF_MAX - _AHS - padding) ) {
-                    return NULL; // request too large for metadata
-                }
-               // At this point we know header_size+mem_pd+padding is
-               // safe to compute.
-                /// @todo: test for ARENAS_MAX_ALLOC
-
-               // Note: chunk_sz does not require any alignment padding,
-               // accounted for.
-                ptrdiff_t real_size = MAX( ( mem_pd + padding + _AHS ), ( ptrdiff_t ) first[n].chunk_sz );
-
-                /* ptrdiff_t chunk_sz = ap->chunk_sz; // save a copy */
-#if 0 == 1
-                fprintf(stderr,"REAL_SIZE: %ld\n",real_size) ;
-#endif
-
-                if ( real_size > (ssize_t)ARENAS_MAX_ALLOC ) {
-                    fprintf( stderr, alloc_emsg2,"_alloc",real_size, ARENAS_MAX_ALLOC );
-                    abort(  );
-                } else if ( tot_mem_usage > ARENAS_MAX_ALLOC - real_size ) {
-                    fprintf( stderr, alloc_emsg3, "_alloc",real_size, ARENAS_MAX_ALLOC );
-                    abort(  );
-                }
-
-                ap = ap->next = malloc( (size_t)real_size );
-                if ( !ap ) {
-                    return NULL; // OOM (can happen on Linux with huge mem_sz!)
-                }
-                tot_mem_usage += real_size ; // updates total allocated.
-                if ( real_size < _128K ) {
-                    arenas_mem_malloced[n] += real_size ;
-                } else {
-                    arenas_mem_mmapped[n] += real_size ;
-                }
-#if         ARENAS_LOG_LEVEL > 0
-#ifndef CORE_ARENA_NO_LOGGING
-                allocated_chunks[n] += real_size;
-                allocation_chunk_count[n] += 1 ;
-#endif
-#endif
-                ap->next = NULL;
-                *p = ap ; // BUGFIX we are breaking out, and won't update in for loop.
-                if ( real_size > (ptrdiff_t) first[n].chunk_sz ) {
-                    ap->chunk_sz = (size_t) (real_size - _AHS) ;
-                } else {
-                    ap->chunk_sz = first[n].chunk_sz;
-                }
-                ap->begin = ( char * ) ap + _AHS;
-                ap->end = ap->begin + ap->chunk_sz;
-                break; // use this arena
-            }
-        } else {
-            break; // found space
+    fprintf( stderr, "\nReport of arena memory usage:\n" "=============================\n" );
+    for ( uint_32 i = 0; i < ARENAS_MAX; ++i ) {
+        struct arena_stats st;
+        arena_stats( i, &st );
+        fprintf( stderr, "Arena nr %u was granted %llu bytes of memory in %llu allocations.\n",
+                 i, st.bytes_granted, st.mallocs );
+        if ( arena_log_level >= FULL_ARENA_LOGGING ) {
+            fprintf( stderr, "Arena nr %u  gave away  %llu bytes of memory in %llu serves.\n",
+                     i, st.bytes_allocated, st.requests );
         }
     }
-
-    void *ptr = ap->begin;
-    ap->begin += mem_pd + padding; // checks passed, so addition is safe
-    // Starting point for next memory allocation.
-
-   // Note: I strongly recommend zero-initialization by default. It
-   // makes for clearer, shorter, and more robust programs. If it's
-   // too slow in some cases, add an opt-out flag.
-
-   // Zeroing out the last byte and the padding
-   // will implement an `arena_calloc` that zeroes out all returned memory,
-   // to follow the usual convention, to get it done! makes swapping methods
-   // easier.
-    for ( char *zptr = ap->begin - ( padding + 1 ); zptr < ap->begin; zptr++ ) {
-        *zptr = '\0';
+    if ( arena_log_level >= FULL_ARENA_LOGGING ) {
+        arena_report_waste( stderr );
     }
-    return ptr;
-   // return memset(ptr, 0, mem_pd);
+    _report_histograms( stderr );
 }
 
 /** @} */
-/**
- * @defgroup UserFuncs User functions 
- * @{
- */
 
 /**
- * @defgroup ConfigFuncs Configuration functions.
+ * @defgroup MemoryCap The cap on the memory of the arenas.
+ * @details
+ * ARENAS_MAX_ALLOC is what all the arenas together may have malloc'ed. In a container the
+ * free memory of the host says little about what we may use, so the memory limit of our
+ * cgroup is used when there is one, and it is watched, so the cap follows the limit.
  * @{
  */
 
-static bool arenas_initialized=false;
-
-static void _arena_teardown(void)
+/** Reads the start of a file into buf, as a string, returns false if it couldn't be read. */
+static bool _read_file( const char *path, char *buf, size_t len )
 {
-    free(first);
-    free(arenas);
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 ) {
+        return false;
+    }
+    ssize_t got = read( fd, buf, len - 1 );
+    close( fd );
+    if ( got <= 0 ) {
+        return false;
+    }
+    buf[got] = '\0';
+    return true;
 }
+
+/** The mounts of the cgroup file systems. */
+#define CGROUP_V2_ROOT "/sys/fs/cgroup"
+#define CGROUP_V1_ROOT "/sys/fs/cgroup/memory"
+#define CGROUP_PATH_SIZE 4096
+
 /**
- * @brief 
- * Initializes the number of arenas.
+ * @brief Watches a file of our cgroup for modifications with inotify.
  * @details
- * Sets a static variable, to show we are initiated.
- * creates arrays fit for the number of arenas
- * installs an exit handler to take down the arenas on exit.
- * Determines logging options if logging is compiled in.
- * Gets the amount of `phys_avail` memory.
- * @param count 1 larger than the last arena, starting at zero.
+ * The kernel notifies a modification of memory.events when a limit is hit, and writing
+ * memory.max or memory.limit_in_bytes modifies them. The descriptor is polled without
+ * blocking by _max_alloc_refresh(). Watching a file again is harmless.
  */
-
-#ifndef CORE_ARENA_NO_LOGGING
-
-static size_t *max_chunk_size; /**< For logging max chunk size for each arena. */
-static size_t *max_mem_request; /**< For logging largest memory request for each arena. */
-static size_t *min_mem_request; /**< For logging smallest memory request for each arena. */
-static size_t *avg_mem_request; /**< for logging average memory request for each arena */
-
+static void _cgroup_watch( const char *file )
+{
+#ifdef __linux__
+    if ( cgroup_watch < 0 ) {
+        cgroup_watch = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    }
+    if ( cgroup_watch >= 0 ) {
+        inotify_add_watch( cgroup_watch, file, IN_MODIFY );
+    }
+#else
+    ( void ) file;
 #endif
+}
 
-void arena_init_arenas(size_t count)
+/**
+ * @brief Finds the cgroup we are in.
+ * @param path Gets the path of the cgroup below the root of the mount, "" for the root.
+ * @param v2 Gets whether it is cgroup v2.
+ * @details
+ * The cgroup is found in /proc/self/cgroup, the v1 memory controller is used when it is
+ * there, as in the hybrid hierarchy, otherwise the v2 one.
+ * @return The mount of the hierarchy, or NULL if there are no cgroups.
+ */
+static const char *_cgroup_path( char *path, size_t len, bool *v2 )
 {
-    static const char *emsg = "core_arena,init_num_arenas: couldn't allocate memory for %s array." ;
-
-    assert( count > 0 ) ;
-    ARENAS_MAX = count ;
-
-    first = calloc(ARENAS_MAX, sizeof(Arena)) ;
-    if (!first) {
-        _errmsg_write( emsg,"first");
-        abort();
-
+    char buf[CGROUP_PATH_SIZE];
+    const char *root = NULL;
+    if ( !_read_file( "/proc/self/cgroup", buf, sizeof buf ) ) {
+        return NULL;
     }
-    arenas  = calloc(ARENAS_MAX, sizeof(Arena*)) ;
-    if (!arenas) {
-        _errmsg_write( emsg,"arenas");
-        abort();
+   // The lines are hierarchy-ID:controller-list:path, the v2 one is 0::path.
+    char *save;
+    for ( char *line = strtok_r( buf, "\n", &save ); line; line = strtok_r( NULL, "\n", &save ) ) {
+        char *controllers = strchr( line, ':' ), *cpath;
+        if ( !controllers || !( cpath = strchr( ++controllers, ':' ) ) ) {
+            continue;
+        }
+        *cpath++ = '\0';
+        bool memory = false;
+        for ( char *c = controllers; *c; c += strcspn( c, "," ), c += *c == ',' ) {
+            memory |= !strncmp( c, "memory", 6 ) && ( c[6] == ',' || c[6] == '\0' );
+        }
+        if ( memory || ( !root && !*controllers ) ) {
+            root = memory ? CGROUP_V1_ROOT : CGROUP_V2_ROOT;
+            *v2 = !memory;
+            snprintf( path, len, "%s", strcmp( cpath, "/" ) ? cpath : "" );
+        }
     }
+    return root;
+}
 
-    arena_chunk_sz  = calloc(ARENAS_MAX, sizeof(size_t)) ;
-    if (!arena_chunk_sz) {
-        _errmsg_write( emsg,"arena_chunk_sz");
-        abort();
+/**
+ * @brief Finds the memory limit of the cgroup we are in, the lowest of it and its
+ * ancestors, and watches their limits for changes.
+ * @details
+ * A cgroup we can't see, like the host's path inside a container without a cgroup
+ * namespace, is skipped, so the limit of the container, at the root of the mount, is
+ * still found.
+ * @return The limit, or SIZE_MAX when there is none, or no cgroups.
+ */
+static size_t _cgroup_limit( void )
+{
+    char buf[CGROUP_PATH_SIZE], path[CGROUP_PATH_SIZE - sizeof CGROUP_V1_ROOT], file[2 * CGROUP_PATH_SIZE];
+    bool v2 = false;
+    const char *root = _cgroup_path( path, sizeof path, &v2 );
+    if ( !root ) {
+        return SIZE_MAX;
     }
-
-    /// @todo those two arrays below not compiled in  when opted out of logging compile time.
-    arenas_mem_malloced = calloc(ARENAS_MAX, sizeof *arenas_mem_malloced );
-    if (!arenas_mem_malloced) {
-        _errmsg_write( emsg,"arenas_mem_malloced");
-        abort();
+    size_t limit = SIZE_MAX;
+    for ( ;; ) {
+        snprintf( file, sizeof file, "%s%s/%s", root, path, v2 ? "memory.max" : "memory.limit_in_bytes" );
+        if ( _read_file( file, buf, sizeof buf ) ) {
+           // "max" is no limit, v1 has a huge number for it, which is above the RAM.
+            unsigned long long v = strncmp( buf, "max", 3 ) ? strtoull( buf, NULL, 10 ) : -1ULL;
+            if ( v && v < limit ) {
+                limit = ( size_t ) v;
+            }
+            _cgroup_watch( file );
+            if ( v2 ) {
+                snprintf( file, sizeof file, "%s%s/memory.events", root, path );
+                _cgroup_watch( file );
+            }
+        }
+        char *up = strrchr( path, '/' );
+        if ( !up ) {
+            break; // That was the root of the mount.
+        }
+        *up = '\0';
     }
+    return limit;
+}
 
-    arenas_mem_mmapped = calloc(ARENAS_MAX, sizeof *arenas_mem_mmapped );
-    if (!arenas_mem_mmapped) {
-        _errmsg_write( emsg,"arenas_mem_mmapped");
-        abort();
+/**
+ * @brief Finds ARENAS_MAX_ALLOC.
+ * @details
+ * An explicit cap wins, then the memory limit of our cgroup, if it is below the physical
+ * memory, and otherwise, as before, the physical memory that is free now.
+ */
+static size_t _max_alloc_find( void )
+{
+    if ( max_alloc_override ) {
+        return max_alloc_override;
     }
-    ARENAS_MAX_ALLOC = ram_avail() ;
-
-#if 0 == 1
-    for (uint_32 i = 0; i < count; ++i) {
-        first[i].next = malloc(sizeof(Arena);
-        
-    } 
-#endif
-    atexit(_arena_teardown) ;
-    arenas_initialized = true ;
+    size_t limit = _cgroup_limit(  );
+    long phys_pages = sysconf( _SC_PHYS_PAGES ), page_size = sysconf( _SC_PAGESIZE );
+    if ( phys_pages > 0 && page_size > 0 && limit / ( size_t ) page_size < ( size_t ) phys_pages ) {
+        return limit < PTRDIFF_MAX ? limit : PTRDIFF_MAX;
+    }
+    return ram_avail();
 }
 
-/** @} */
+/** The limits of the cgroup are looked at again at most this often, in nanoseconds. */
+#define CGROUP_CHECK_NS 10000000u
 
 /**
- * @defgroup AllocFuncs Allocation functions. 
- * @{
- */
-/**
- * @brief Allocates memory for an object from an arena.
- * @param n The index of the arena to request memory from.
- * @param mem_sz The amount of memory we want to allocate.
+ * @brief Finds ARENAS_MAX_ALLOC again if the limits of the cgroup have been touched, called
+ * before a chunk is malloc'ed.
  * @details
- * Just calls  _alloc(), if there isn't enough memory to satisfy the request.
+ * Reads the inotify descriptor at most every CGROUP_CHECK_NS, by one thread, so most calls
+ * cost a read of the coarse clock, which is not a system call. A read() that fails with
+ * EAGAIN is what it costs when nothing has happened.
  */
-
-void *arena_alloc( size_t n, size_t mem_sz )
+static void _max_alloc_refresh( void )
 {
-    assert( arenas_initialized == true ) ;
-
-    if ( n >= ARENAS_MAX ) {
-        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
-        abort(  ); // Overflow conditions.
+#ifdef __linux__
+    if ( cgroup_watch < 0 ) {
+        return;
     }
-
-    static const char *emsg = "arena_alloc: Couldn't allocate memory for arena with mem_pd: %lu.\n" ;
-   // First reject anything nonsensical or excessively large .
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    uint64_t now = ( uint64_t ) ts.tv_sec * 1000000000u + ( uint64_t ) ts.tv_nsec,
+        last = __atomic_load_n( &cgroup_checked, __ATOMIC_RELAXED );
+    if ( now - last < CGROUP_CHECK_NS
+         || !__atomic_compare_exchange_n( &cgroup_checked, &last, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+        return; // Looked at lately, or another thread is looking.
+    }
+   // One read takes the events that have queued up, and one look at the limits covers them.
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int saved_errno = errno;
+    ssize_t got = read( cgroup_watch, buf, sizeof buf );
+    errno = saved_errno;
+    if ( got <= 0 ) {
+        return;
+    }
+    size_t cap = _max_alloc_find(  );
+    if ( __atomic_exchange_n( &ARENAS_MAX_ALLOC, cap, __ATOMIC_RELAXED ) != cap
+         && arena_log_level >= LOG_CHUNK_MALLOCS ) {
+        _logmsg_write( "core_arena: ARENAS_MAX_ALLOC is now %zu bytes, the cgroup changed.\n", cap );
+    }
+#endif
+}
+
+/**
+ * @brief Sets the cap from CORE_ARENA_MAX_ALLOC, in bytes, or with a K, M or G suffix, if
+ * it is set.
+ */
+static void _max_alloc_from_env( void )
+{
+    const char *env = getenv( "CORE_ARENA_MAX_ALLOC" );
+    if ( !env || !*env ) {
+        return;
+    }
+    char *end;
+    unsigned long long v = strtoull( env, &end, 10 );
+    int shift = 0;
+    switch ( *end ) {
+    case 'G': case 'g': shift = 30; break;
+    case 'M': case 'm': shift = 20; break;
+    case 'K': case 'k': shift = 10; break;
+    }
+    if ( v > ( unsigned long long ) PTRDIFF_MAX >> shift ) {
+        v = ( unsigned long long ) PTRDIFF_MAX >> shift;
+    }
+    max_alloc_override = ( size_t ) ( v << shift );
+}
+
+/** @} */
+/**
+ * @defgroup InternalFuncs Internal functions. 
+ * @{
+ */
+
+/**
+ * @brief The bytes to ask malloc for for a chunk with the header in it, so that malloc
+ * reserves no more than reserve bytes, and uses all of them.
+ * @details
+ * Below the mmap threshold that is a whole number of MAX_ALIGN units less malloc's header.
+ * So for instance the smart size to ask for is 4096-8 == 4088, which makes malloc reserve
+ * exactly 4096 bytes for it. Above it, malloc maps whole pages, so it is the whole pages
+ * less what malloc keeps of them. Asking for 1M - 16 would map a page more than 1M.
+ */
+static ptrdiff_t _chunk_request( size_t reserve )
+{
+    if ( mmap_hdr_sz && reserve >= __atomic_load_n( &mmap_threshold, __ATOMIC_RELAXED ) && reserve >= page_sz ) {
+        return ( ptrdiff_t ) ( reserve & ~( page_sz - 1 ) ) - mmap_hdr_sz;
+    }
+    return ( ( ptrdiff_t ) reserve - malloc_hdr_sz ) & -( ptrdiff_t ) MAX_ALIGN;
+}
+
+/**
+ * @brief Whether malloc served a block of got bytes with mmap.
+ * @details
+ * glibc keeps one size_t of a block on the heap, which is whole MAX_ALIGN units, and two of
+ * a mapping, which is whole pages, so what is usable of a block tells which it is, whatever
+ * the threshold is now. Otherwise it is what mmap_threshold says.
+ */
+static inline bool _chunk_mmapped( void *block, size_t got )
+{
+#ifdef __GLIBC__
+    ( void ) got;
+    return ( ( malloc_usable_size( block ) + ( size_t ) malloc_hdr_sz ) & ( MAX_ALIGN - 1 ) ) != 0;
+#else
+    ( void ) block;
+    return got >= __atomic_load_n( &mmap_threshold, __ATOMIC_RELAXED );
+#endif
+}
+
+/**
+ * @brief Forgets the checkpoints of an arena, the files stay.
+ */
+static void _ckpt_free( ArenaDesc *a )
+{
+    struct checkpoint *ck = a->ckpt;
+    if ( ck ) {
+        if ( ck->pagemap >= 0 ) {
+            close( ck->pagemap );
+        }
+        free( ck->dir );
+        free( ck->chunk );
+        free( ck->stale );
+        free( ck );
+        a->ckpt = NULL;
+    }
+}
+
+/**
+ * @brief Takes a chunk of size bytes from the file of a mapped arena, with a malloc'ed
+ * record for its header.
+ * @details
+ * The chunks the table of a reopened file has are taken in order first, then the file is
+ * grown at its end, with posix_fallocate(), so a full disk fails here and not with a
+ * SIGBUS when the chunk is written.
+ * @return The record, or NULL with errno set when the reserve or the table is full.
+ */
+static Arena *_map_chunk( ArenaDesc *a, size_t size )
+{
+    struct mapping *m = a->map;
+    struct arena_file_header *h = m->hdr;
+    bool adopt = m->adopted < h->chunks;
+    if ( adopt ? h->chunk[m->adopted].offset != m->size || h->chunk[m->adopted].size != size
+               : h->chunks == h->max_chunks || size > h->reserve - m->size ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    Arena *ap = malloc( sizeof *ap );
+    if ( !ap ) {
+        return NULL;
+    }
+    if ( !adopt ) {
+        int err = posix_fallocate( m->fd, ( off_t ) m->size, ( off_t ) size );
+        if ( err == EINVAL || err == EOPNOTSUPP ) { // The file system can't, grow it sparse.
+            err = ftruncate( m->fd, ( off_t ) ( m->size + size ) ) ? errno : 0;
+        }
+        if ( err ) {
+            free( ap );
+            errno = err;
+            return NULL;
+        }
+        h->chunk[h->chunks].offset = m->size;
+        h->chunk[h->chunks].size = size;
+        h->chunks += 1;
+    }
+    m->adopted += 1;
+    ap->base = m->base + m->size;
+    ap->end = ap->base + size;
+    m->size += size;
+    return ap;
+}
+
+/**
+ * @brief Records where a mapped arena allocates from in its file, and writes the chunk it
+ * has moved on from back, as its sync mode says.
+ * @param a The descriptor of the arena.
+ * @param left The chunk moved on from, or NULL.
+ */
+static void _map_mark( ArenaDesc *a, Arena *left )
+{
+    struct mapping *m = a->map;
+    if ( a->cur ) {
+        m->hdr->cur = ( uint64_t ) ( a->cur->base - m->base );
+        m->hdr->begin = ( uint64_t ) ( a->begin - m->base );
+    }
+    if ( left && left != a->cur && m->sync != ARENA_SYNC_NONE ) {
+        msync( left->base, ( size_t ) ( left->end - left->base ), m->sync == ARENA_SYNC_WAIT ? MS_SYNC : MS_ASYNC );
+    }
+}
+
+/**
+ * @brief Mallocs a chunk of size bytes, accounts for it, and links it in after tail, or as
+ * the head of the arena if tail is NULL.
+ * @details
+ * With the default layout size includes the header, with out of band headers size is just
+ * the part we hand out, and the header is malloc'ed separately. Whatever malloc gives us
+ * beyond what we asked for is used too, and that is what we account for.
+ * @return The new chunk, or NULL if malloc failed.
+ */
+static Arena *_chunk_new( ArenaDesc *a, Arena *tail, ptrdiff_t size )
+{
+    Arena *ap;
+    size_t got;
+    if ( a->map ) {
+        ap = _map_chunk( a, (size_t) size );
+        if ( !ap ) {
+            return NULL;
+        }
+        got = (size_t) size;
+    } else if ( a->align ) {
+        char *base;
+        if ( posix_memalign( ( void ** ) &base, a->align, (size_t) size ) ) {
+            return NULL;
+        }
+        ap = malloc( sizeof *ap );
+        if ( !ap ) {
+            free( base );
+            return NULL;
+        }
+        got = _usable_size( base, (size_t) size );
+        ap->base = base;
+        ap->end = base + got;
+        got += _usable_size( ap, sizeof *ap );
+    } else {
+        ap = malloc( (size_t) size );
+        if ( !ap ) {
+            return NULL; // OOM (can happen on Linux with huge mem_sz!)
+        }
+        got = _usable_size( ap, (size_t) size );
+        ap->base = ( char * ) ap + _AHS;
+        ap->end = ( char * ) ap + got;
+    }
+   // The pages of a file are the page cache's, and are written back rather than swapped.
+    if ( !a->map ) {
+        __atomic_add_fetch( &tot_mem_usage, got, __ATOMIC_RELAXED ); // updates total allocated.
+    }
+    bool mmapped = a->map || _chunk_mmapped( a->align ? ap->base : ( char * ) ap, got );
+    if ( !mmapped ) {
+        a->mem_malloced += got ;
+    } else {
+        a->mem_mmapped += got ;
+    }
+   // Follow glibc's dynamic threshold, which is somewhere between what it maps and not.
+    size_t threshold = __atomic_load_n( &mmap_threshold, __ATOMIC_RELAXED );
+    if ( !mmap_threshold_pinned && !a->align && !a->map && mmapped != ( (size_t) size >= threshold ) ) {
+        __atomic_store_n( &mmap_threshold, mmapped ? (size_t) size : (size_t) size + 1, __ATOMIC_RELAXED );
+    }
+    a->chunks += 1 ;
+    a->mallocs += 1 ;
+    a->bytes_granted += got ;
+    if ( arena_log_level >= FULL_ARENA_LOGGING ) {
+        _logmsg_write( "Arena nr %lu was granted a chunk of %lu bytes.\n", (unsigned long) ( a - descs ), got );
+    }
+    if ( got > a->max_chunk_size ) {
+        a->max_chunk_size = got ;
+    }
+    if ( (size_t) size > a->chunk_sz ) { // A one-off.
+        a->bytes_oversized += got;
+        a->oversized_chunks += 1;
+    }
+    ap->next = NULL;
+    ap->chunk_sz = (size_t) size;
+    if ( tail ) {
+        tail->next = ap;
+    } else {
+        a->head = ap;
+    }
+    return ap;
+}
+
+/**
+ * @brief The number of bytes malloc has reserved for a chunk, as accounted by _chunk_new().
+ */
+static inline size_t _chunk_got( const ArenaDesc *a, Arena *ap )
+{
+    if ( a->map ) {
+        return ( size_t ) ( ap->end - ap->base );
+    }
+    if ( a->align ) {
+        return _usable_size( ap->base, ap->chunk_sz ) + _usable_size( ap, sizeof *ap );
+    }
+    return _usable_size( ap, ap->chunk_sz );
+}
+
+/**
+ * @brief Frees a chunk, and its header if it is kept out of band. The chunks of a mapped
+ * arena stay in the file, and are unmapped with it.
+ */
+static inline void _chunk_free( ArenaDesc *a, Arena *ap )
+{
+    if ( a->align && !a->map ) {
+        free( ap->base );
+    }
+    free( ap );
+}
+
+/**
+ * @brief Makes ap the chunk the fast path allocates from, from the start of the chunk.
+ */
+static inline void _chunk_use( ArenaDesc *a, Arena *ap )
+{
+    a->cur = ap;
+    a->begin = ap->base;
+    a->end = ap->end;
+}
+
+/**
+ * @brief Checks the budgets of an arena before size more bytes are malloc'ed for it.
+ * @details
+ * The soft budget calls budget_fn once when it is crossed, it is called again after the
+ * arena has been under it. The callback may change the budgets with arena_set_budget(),
+ * so the hard budget is checked after it.
+ * @return Whether the hard budget allows it.
+ */
+static bool _budget_check( ArenaDesc *a, size_t n, size_t size )
+{
+    size_t reserved = a->mem_malloced + a->mem_mmapped;
+    if ( !a->budget_soft || reserved + size <= a->budget_soft ) {
+        a->budget_fired = false;
+    } else if ( !a->budget_fired ) {
+        a->budget_fired = true;
+        if ( a->budget_fn ) {
+            a->budget_fn( n, reserved + size, a->budget_ctx );
+        }
+    }
+    return !a->budget_hard || reserved + size <= a->budget_hard;
+}
+
+/**
+ * @brief
+ * Initializes an arena and configures it with the effective chunk_size, and allocates the
+ * memory, with malloc().
+ * @param n The arena numberer we arena initializing.
+ * @param chunk_sz  The number of bytes malloc should reserve for a chunk, header included.
+ * @details
+ * We consider how malloc operates carefully to optimize block sizes and thereby improves
+ * efficiency of the heap.
+ * * The  amount of memory that malloc needs to store a pointer in the block is subtracted
+ * from the requested memory.
+ * * We do this, so that it is easy to use block sizes the size of page size (4096), whole
+ * multiples of that, or whole parts of that, (2048, 1024, 512, 256, 128, 64.). This makes
+ * it faster to allocate blocks, and if malloc needs to split blocks delivered from the
+ * heap, then the heap is kept as tidy as  posible.
+ * * I recommend the smallest chunk_sz requested to be 1024 bytes.
+ * * With out of band headers, the chunk_sz is rounded up to a whole number of the
+ * alignment, as then all of it is handed out.
+ * @return The first chunk, or NULL with errno ENOMEM when it would go over
+ * ARENAS_MAX_ALLOC or the hard budget, or malloc failed.
+ */
+static const char *alloc_emsg = "%s: The chunk_sz requested is to small: %lu\n";
+static const char *alloc_emsg2 = "%s: The chunk_sz: %lu requested is too large.\n"
+                           "The request is larger than ARENAS_MAX_ALLOC %lu: ";
+static const char *alloc_emsg3 = "%s: The chunk_sz: %lu requested is too large.\n"
+                           "It will make the total number of bytes requested larger than ARENAS_MAX_ALLOC %lu: ";
+static Arena *_arena_init( size_t n, size_t chunk_sz )
+{
+    ArenaDesc *a = &descs[n];
+    ptrdiff_t chunk_pd = chunk_sz; // maybe someone without gcc wants to compile it.
+
+    if ( chunk_pd <  malloc_hdr_sz + MAX_ALIGN ) {
+        fprintf( stderr, alloc_emsg, "_arena_init", chunk_sz );
+        abort(  );
+    }
+    if ( a->align ) {
+       // No header in the chunk, so it is just a whole number of alignment units.
+        ptrdiff_t align = a->align;
+        if ( chunk_pd > PTRDIFF_MAX - align ) {
+            fprintf( stderr, alloc_emsg2, "_arena_init", chunk_pd, _max_alloc() );
+            abort(  );
+        }
+        chunk_pd = ( chunk_pd + align - 1 ) & -align;
+    } else {
+       // Whole MAX_ALIGN units less malloc's header, or whole pages, see _chunk_request().
+        chunk_pd = _chunk_request( chunk_sz );
+        if ( chunk_pd <= ( ptrdiff_t ) _AHS ) {
+            fprintf( stderr, alloc_emsg,"_arena_init", chunk_sz );
+            abort(  );
+        }
+    }
+
+    a->chunk_sz = (size_t) chunk_pd;
+    _max_alloc_refresh(  );
+    if ( chunk_pd > (ssize_t) (_max_alloc() - malloc_hdr_sz)
+         || __atomic_load_n( &tot_mem_usage, __ATOMIC_RELAXED ) > _max_alloc() - (chunk_pd + malloc_hdr_sz)
+         || ( ( a->budget_soft || a->budget_hard ) && !_budget_check( a, n, (size_t) chunk_pd ) ) ) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    Arena *p = _chunk_new( a, NULL, chunk_pd );
+    if ( !p ) {
+        errno = ENOMEM;
+        return NULL;
+    } 
+    _chunk_use( a, p );
+   // see https://nullprogram.com/blog/2023/09/27/ (the alloca() function //
+    return p;
+}
+
+/**
+ * @brief Refills the descriptor with a chunk that can serve the request, allocating a new
+ * chunk if necessary for delivering the request.
+ * @param a The descriptor of the arena to request memory from.
+ * @param mem_pd The amount of memory requested, already padded to MAX_ALIGN.
+ * @param n The arena number so we can log allocations to it.
+ * @detail
+ * This is basically Hanson's work.
+ * This scheme is like it is so that it can work after a deallocation of the areas too,
+ * reusing the previously not freed memory: the chunks after the current one are retained
+ * from earlier lifetimes, and are reset as we walk into them.
+ * Algorithm taken from Hanson p. 3 where it is described, but with padding method from
+ * Wellons, in addition I have added a "fail-safe" for when the ask for memory is larger
+ * than then chunk_sz the arena is currently configured for, so that it will then as a
+ * "one-off" case allocate a sufficiently large block.
+ * 23-12-27: Now this is basically u/skeetos work for I have followed most of his 
+ * recommendations in hardening the function.
+ */
+static void *_alloc( ArenaDesc *a, ptrdiff_t mem_pd, size_t n )
+{
+    if ( a->chunk_sz == 0 ) {
+        fprintf( stderr, msgNoArena, n );
+        abort(  );
+    }
+    _desc_claim( a ); // The lifetime gets past the head.
+    unsigned long long tail_mark = a->bytes_tail; // Restored when a budget fails the request.
+    Arena *left = a->cur;
+    a->refills += 1 ;
+    a->bytes_tail += a->end - a->begin ; // What is left in the current chunk is lost.
+    Arena *ap,
+    *tail = a->cur;
+    for ( ap = tail ? tail->next : a->head; ap; tail = ap, ap = ap->next ) {
+       // Work using a size, not with pointer arithmetic.
+        if ( mem_pd <= ap->end - ap->base ) {
+            break; // found space in a retained chunk.
+        }
+        a->bytes_tail += ap->end - ap->base ; // and so is a chunk we walk past.
+    }
+
+    if ( !ap ) { // End of the list, allocate a new chunk.
+       // The header is either in the chunk, or the chunk is rounded up to the alignment.
+        ptrdiff_t header_size = a->align ? ( ptrdiff_t ) a->align - 1 : _AHS;
+       // It is *not* yet safe to add header_size to mem_pd,
+       // so subtract from the other side.
+        if ( mem_pd > (PTRDIFF_MAX - header_size) ) {
+            goto fail; // request too large for metadata
+        }
+       // At this point we know header_size+mem_pd is safe to compute.
+       // Note: chunk_sz does not require any alignment padding, accounted for.
+        ptrdiff_t real_size = a->align ? ( mem_pd + header_size ) & -( ptrdiff_t ) a->align
+                                       : mem_pd + header_size;
+        real_size = MAX( real_size, ( ptrdiff_t ) a->chunk_sz );
+
+        _max_alloc_refresh(  );
+       // A mapped arena is held by its reserve instead.
+        bool over_cap = !a->map && ( real_size > (ssize_t)_max_alloc()
+                        || __atomic_load_n( &tot_mem_usage, __ATOMIC_RELAXED ) > _max_alloc() - real_size );
+        if ( ( a->budget_soft || a->budget_hard ) && ( !_budget_check( a, n, (size_t) real_size ) || over_cap ) ) {
+           // An arena with a budget fails the request instead, over its budget or the cap.
+            goto fail;
+        }
+        if ( over_cap && real_size > (ssize_t)_max_alloc() ) {
+            fprintf( stderr, alloc_emsg2,"_alloc",real_size, _max_alloc() );
+            abort(  );
+        } else if ( over_cap ) {
+            fprintf( stderr, alloc_emsg3, "_alloc",real_size, _max_alloc() );
+            abort(  );
+        }
+
+        ap = _chunk_new( a, tail, real_size );
+        if ( !ap ) {
+            goto fail;
+        }
+    }
+    _chunk_use( a, ap );
+
+    void *ptr = a->begin;
+    a->begin += mem_pd; // checks passed, so addition is safe
+    // Starting point for next memory allocation.
+    if ( a->map ) {
+        _map_mark( a, left );
+    }
+    return ptr;
+fail:
+   // The descriptor is where it was, so the tail is counted when it is really left.
+    a->refills -= 1;
+    a->bytes_tail = tail_mark;
+    errno = ENOMEM;
+    return NULL;
+}
+
+/**
+ * @brief Unlinks the chunk *link points to, takes it out of the accounting, and frees it.
+ * @return The bytes malloc had reserved for it.
+ */
+static size_t _chunk_release( ArenaDesc *a, Arena **link )
+{
+    Arena *ap = *link;
+    *link = ap->next;
+    size_t got = _chunk_got( a, ap );
+    if ( ap->chunk_sz > a->chunk_sz ) {
+        a->bytes_oversized -= got;
+        a->oversized_chunks -= 1;
+    }
+    __atomic_sub_fetch( &tot_mem_usage, got, __ATOMIC_RELAXED );
+    if ( !_chunk_mmapped( a->align ? ap->base : ( char * ) ap, got ) ) {
+        a->mem_malloced -= got;
+    } else {
+        a->mem_mmapped -= got;
+    }
+    a->chunks -= 1;
+    _chunk_free( a, ap );
+    return got;
+}
+
+/**
+ * @brief Frees the chunks retained after the current one, which the lifetime in progress
+ * hasn't got to.
+ * @return The bytes freed.
+ */
+static size_t _trim( ArenaDesc *a )
+{
+    size_t freed = 0;
+    if ( a->map ) {
+        return 0; // The chunks are in the file, and the kernel writes them back under pressure.
+    }
+    while ( a->cur && a->cur->next ) {
+        freed += _chunk_release( a, &a->cur->next );
+    }
+    return freed;
+}
+
+/**
+ * @brief Counts the chunks made for more than the chunk_sz of the arena again, after it has
+ * changed, so the statistics can be read without walking the chain.
+ */
+static void _oversized_count( ArenaDesc *a )
+{
+    a->bytes_oversized = a->oversized_chunks = 0;
+    for ( Arena *ap = a->head; ap; ap = ap->next ) {
+        if ( ap->chunk_sz > a->chunk_sz ) {
+            a->bytes_oversized += _chunk_got( a, ap );
+            a->oversized_chunks += 1;
+        }
+    }
+}
+
+/** The adaptive arenas size their chunks for this many requests of the largest common size. */
+#define ADAPT_REQUESTS 8
+
+/**
+ * @brief The bytes to ask malloc for for a chunk that hands out want bytes.
+ * @details
+ * Rounded up to a power of two up to the page size, and to whole pages above it, then
+ * clamped to the bounds of the arena, and adjusted for the headers like _arena_init().
+ */
+static size_t _adapt_chunk_sz( const ArenaDesc *a, size_t want )
+{
+    size_t sz = want + ( a->align ? 0 : ( size_t ) _AHS + ( size_t ) malloc_hdr_sz );
+    if ( sz <= page_sz ) {
+        size_t p2 = 64;
+        while ( p2 < sz ) {
+            p2 <<= 1;
+        }
+        sz = p2;
+    } else {
+        sz = ( sz + page_sz - 1 ) & ~( page_sz - 1 );
+    }
+    sz = sz < a->adapt_min ? a->adapt_min : sz > a->adapt_max ? a->adapt_max : sz;
+    if ( a->align ) {
+        return ( sz + a->align - 1 ) & -a->align;
+    }
+    return ( size_t ) _chunk_request( sz );
+}
+
+/**
+ * @brief Adjusts the chunk_sz of an adaptive arena at the end of a lifetime.
+ * @param a The descriptor of the arena.
+ * @param used The bytes handed out during the lifetime, padding included.
+ * @details
+ * The arena is sized for the peak of its lifetimes, as the 90th percentile of the sketch if
+ * the histograms are collected, and otherwise as a maximum that decays by a quarter every
+ * lifetime, so one large lifetime doesn't keep the chunks large forever. The chunks must
+ * also hold ADAPT_REQUESTS of the largest common request, so those don't become one-offs.
+ * After a lifetime that needed more than one chunk, the retained chunks that are smaller
+ * than the new chunk_sz are freed, except for the head when no chunk is large enough, so
+ * the chain converges to a few large chunks instead of walking many small ones every
+ * lifetime. It is called before the head is made current again.
+ */
+static void _adapt( ArenaDesc *a, size_t used )
+{
+    size_t want = a->adapt_want - a->adapt_want / 4;
+    size_t large = a->max_request;
+    if ( a->hist ) {
+        want = arena_hist_peak_quantile( a->hist, 0.9 );
+        want += want / 8; // The quantile is the lower bound of its bucket.
+       // The largest size class with at least 1% of the requests.
+        unsigned long long total = 0;
+        for ( unsigned i = 0; i < ARENA_HIST_SIZES; ++i ) {
+            total += a->hist->sizes[i];
+        }
+        for ( unsigned i = ARENA_HIST_SIZES; i-- > 0; ) {
+            if ( a->hist->sizes[i] * 100 >= total && a->hist->sizes[i] ) {
+                large = i < 63 ? ( ( size_t ) 2 << i ) - 1 : SIZE_MAX;
+                break;
+            }
+        }
+    }
+    if ( used > want ) {
+        want = used;
+    }
+    a->adapt_want = want;
+    if ( large <= SIZE_MAX / ADAPT_REQUESTS && want < large * ADAPT_REQUESTS ) {
+        want = large * ADAPT_REQUESTS;
+    }
+
+    a->chunk_sz = _adapt_chunk_sz( a, want );
+    _oversized_count( a );
+    if ( a->refills == a->refill_mark || !a->head ) {
+        return;
+    }
+    size_t header_size = a->align ? 0 : ( size_t ) _AHS;
+    Arena *keep,
+    *ap,
+    **link;
+   // Keep the first chunk that is large enough, or the head, so the chain is never empty.
+    for ( keep = a->head; keep; keep = keep->next ) {
+        if ( ( size_t ) ( keep->end - keep->base ) + header_size >= a->chunk_sz ) {
+            break;
+        }
+    }
+    if ( !keep ) {
+        keep = a->head;
+    }
+    for ( link = &a->head; ( ap = *link ); ) {
+        if ( ap == keep || ( size_t ) ( ap->end - ap->base ) + header_size >= a->chunk_sz ) {
+            link = &ap->next;
+            continue;
+        }
+        _chunk_release( a, link );
+    }
+}
+
+/** The number of events in the ring of a thread, flushed to the trace file when full. */
+#define TRACE_RING 4096
+
+static bool trace_on;         /**< Set while an allocation trace is recorded, atomic. */
+static unsigned trace_gen;    /**< Bumped by every arena_trace_start(), atomic. */
+static unsigned trace_writers; /**< The threads writing a ring to trace_fd, atomic. */
+static int trace_fd = -1;     /**< The trace file, opened with O_APPEND. */
+static struct timespec trace_start; /**< The time stamps are relative to this. */
+static __thread struct arena_trace_event *trace_ring; /**< The ring of this thread. */
+static __thread unsigned trace_len; /**< The events in the ring of this thread. */
+static __thread unsigned trace_ring_gen; /**< The trace_gen of the events in the ring. */
+static pthread_key_t trace_key;  /**< Flushes and frees the ring of a thread that exits. */
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+/** Whether an allocation trace is recorded, a plain load on x86, predicted not to be. */
+static inline bool _tracing( void )
+{
+    return __builtin_expect( __atomic_load_n( &trace_on, __ATOMIC_ACQUIRE ), 0 );
+}
+
+/**
+ * @brief Writes the events in the ring of this thread to the trace file.
+ * @details
+ * The ring goes in one write to a file opened with O_APPEND, so the rings of different
+ * threads don't interleave. The events of a trace that has been stopped are dropped, and
+ * arena_trace_stop() waits for the writes in progress before it closes the file.
+ */
+static void _trace_flush_ring( void )
+{
+    if ( trace_len ) {
+       // Every step of the handshake with arena_trace_stop() is sequentially consistent.
+        __atomic_add_fetch( &trace_writers, 1, __ATOMIC_SEQ_CST );
+        if ( __atomic_load_n( &trace_on, __ATOMIC_SEQ_CST )
+             && trace_ring_gen == __atomic_load_n( &trace_gen, __ATOMIC_SEQ_CST ) ) {
+            _write_all( trace_fd, ( const char * ) trace_ring, trace_len * sizeof *trace_ring );
+        }
+        __atomic_sub_fetch( &trace_writers, 1, __ATOMIC_SEQ_CST );
+    }
+    trace_len = 0;
+}
+
+/** The destructor of trace_key, writes what is left in the ring of an exiting thread. */
+static void _trace_ring_exit( void *ring )
+{
+    _trace_flush_ring(  );
+    free( ring );
+    trace_ring = NULL;
+}
+
+static void _trace_key_create( void )
+{
+    pthread_key_create( &trace_key, _trace_ring_exit );
+}
+
+/**
+ * @brief Records an event in the ring of this thread, flushing it first if it is full.
+ * @param type One of the ARENA_TRACE_* event types.
+ * @param n The arena.
+ * @param size The size of the request, or the chunk_sz for ARENA_TRACE_CREATE.
+ * @param aux The log2 of the alignment for ARENA_TRACE_CREATE, 0 otherwise.
+ * @details
+ * Out of line and cold, so the fast paths only pay the branch on trace_on.
+ */
+__attribute__((noinline, cold))
+static void _trace_event( unsigned type, size_t n, size_t size, unsigned aux )
+{
+    if ( !trace_ring ) {
+        trace_ring = malloc( TRACE_RING * sizeof *trace_ring );
+        if ( !trace_ring ) {
+            return; // Better a trace with a hole than no allocation.
+        }
+        pthread_once( &trace_key_once, _trace_key_create );
+        pthread_setspecific( trace_key, trace_ring );
+    }
+    unsigned gen = __atomic_load_n( &trace_gen, __ATOMIC_SEQ_CST );
+    if ( trace_ring_gen != gen ) { // Left over from a trace that was stopped.
+        trace_ring_gen = gen;
+        trace_len = 0;
+    }
+    if ( trace_len == TRACE_RING ) {
+        _trace_flush_ring(  );
+    }
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    struct arena_trace_event *ev = &trace_ring[trace_len++];
+    ev->ts = ( uint64_t ) ( ts.tv_sec - trace_start.tv_sec ) * 1000000000u
+             + ( uint64_t ) ts.tv_nsec - ( uint64_t ) trace_start.tv_nsec;
+    ev->size = size;
+    ev->arena = ( uint32_t ) n;
+    ev->type = ( uint16_t ) type;
+    ev->aux = ( uint16_t ) aux;
+}
+
+/** @} */
+/**
+ * @defgroup UserFuncs User functions 
+ * @{
+ */
+
+/**
+ * @defgroup ConfigFuncs Configuration functions.
+ * @{
+ */
+
+static bool arenas_initialized=false;
+
+/**
+ * @brief Finds the number of bytes malloc keeps in front of a block, and of a mapping.
+ * @details
+ * Malloc hands out blocks in MAX_ALIGN sized units, and what is usable of a block is the
+ * unit minus the header, so that is what is missing from a whole number of units.
+ *
+ * glibc rounds a request and its header up to MAX_ALIGN, and keeps another header in front
+ * of a mapping, so that is what a request must leave of its pages. When the threshold is
+ * pinned that is taken as it is. Else one block of that size is asked for, a page above the
+ * current threshold, and if it is mapped as just those pages, it holds. Freeing it moves
+ * glibc's dynamic threshold to it, and mmap_threshold follows. It is done once, later calls
+ * keep what the first one found.
+ */
+static void _malloc_hdr_calibrate( void )
+{
+    static bool calibrated;
+    if ( calibrated ) {
+        return;
+    }
+    calibrated = true;
+    long page = sysconf( _SC_PAGESIZE );
+    if ( page > 0 ) {
+        page_sz = ( size_t ) page;
+    }
+#ifdef __GLIBC__
+    void *p = malloc( 1 );
+    if ( p ) {
+        ptrdiff_t rest = ( ptrdiff_t ) malloc_usable_size( p ) & ( MAX_ALIGN - 1 );
+        malloc_hdr_sz = rest ? MAX_ALIGN - rest : 0;
+        free( p );
+    }
+    ptrdiff_t h = ( ( malloc_hdr_sz + MAX_ALIGN - 1 ) & ~( MAX_ALIGN - 1 ) ) + malloc_hdr_sz;
+    h = ( h + MAX_ALIGN - 1 ) & ~( MAX_ALIGN - 1 );
+    if ( mmap_threshold_pinned ) {
+        mmap_hdr_sz = h;
+        return;
+    }
+    size_t threshold = __atomic_load_n( &mmap_threshold, __ATOMIC_RELAXED );
+    size_t probe = ( ( threshold + page_sz - 1 ) & ~( page_sz - 1 ) ) + page_sz;
+    p = malloc( probe - ( size_t ) h );
+    if ( !p ) {
+        return;
+    }
+    bool fits = malloc_usable_size( p ) < probe, mapped = _chunk_mmapped( p, probe );
+    free( p );
+    if ( mapped ) {
+        __atomic_store_n( &mmap_threshold, fits ? probe : probe + page_sz, __ATOMIC_RELAXED );
+    }
+    if ( mapped && fits ) {
+        mmap_hdr_sz = h;
+    }
+#endif
+}
+
+/**
+ * @brief Pins the mmap threshold from CORE_ARENA_MMAP_THRESHOLD, in bytes, or with a K or
+ * M suffix, if it is set.
+ */
+static void _mmap_threshold_from_env( void )
+{
+    const char *env = getenv( "CORE_ARENA_MMAP_THRESHOLD" );
+    if ( !env || !*env ) {
+        return;
+    }
+    char *end;
+    unsigned long long v = strtoull( env, &end, 10 );
+    v <<= *end == 'M' || *end == 'm' ? 20 : *end == 'K' || *end == 'k' ? 10 : 0;
+    if ( v && v <= INT_MAX ) {
+        arena_set_mmap_threshold( ( size_t ) v );
+    }
+}
+
+/**
+ * @brief Frees the descriptors at exit, and what they hold but the chunks from malloc.
+ * @details
+ * The mapped arenas are destroyed, so their files get where they are, synced as their sync
+ * mode says, and are unmapped and closed. The checkpoints on disk stay as they are.
+ */
+static void _arena_teardown(void)
+{
+    for ( size_t n = 0; n < ARENAS_MAX; ++n ) {
+        if ( descs[n].map ) {
+            arena_destroy( n );
+        }
+        free( descs[n].hist );
+        _ckpt_free( &descs[n] );
+    }
+    free(descs);
+}
+/**
+ * @brief 
+ * Initializes the number of arenas.
+ * @details
+ * Sets a static variable, to show we are initiated.
+ * creates arrays fit for the number of arenas
+ * installs an exit handler to take down the arenas on exit.
+ * Determines the logging level from the environment.
+ * Finds ARENAS_MAX_ALLOC, from CORE_ARENA_MAX_ALLOC, the memory limit of our cgroup, or the
+ * physical memory that is free.
+ * @param count 1 larger than the last arena, starting at zero.
+ */
+
+void arena_init_arenas(size_t count)
+{
+    static const char *emsg = "core_arena,init_num_arenas: couldn't allocate memory for %s array." ;
+
+    assert( count > 0 ) ;
+    ARENAS_MAX = count ;
+
+    // The descriptors must start on a cache line, or the padding is for nothing.
+    errno = posix_memalign( (void **) &descs, CACHE_LINE_SIZE, ARENAS_MAX * sizeof *descs ) ;
+    if (errno) {
+        _errmsg_write( emsg,"descs");
+        abort();
+    }
+    memset( descs, 0, ARENAS_MAX * sizeof *descs ) ;
+    _mmap_threshold_from_env() ;
+    _malloc_hdr_calibrate() ;
+
+    if ( !max_alloc_override ) {
+        _max_alloc_from_env() ;
+    }
+    ARENAS_MAX_ALLOC = _max_alloc_find(  ) ;
+
+    _log_level_from_env() ;
+    atexit(_arena_teardown) ;
+    atexit(report_memory_usage) ;
+    arenas_initialized = true ;
+}
+
+/**
+ * @brief Sets ARENAS_MAX_ALLOC, the cap on the bytes all the arenas together may have
+ * malloc'ed.
+ * @param bytes The cap, or 0 to find it again from the cgroup or the free memory.
+ * @details
+ * May be called before arena_init_arenas(), and then overrides CORE_ARENA_MAX_ALLOC.
+ */
+void arena_set_max_alloc( size_t bytes )
+{
+    max_alloc_override = bytes < PTRDIFF_MAX ? bytes : PTRDIFF_MAX;
+    if ( arenas_initialized ) {
+        __atomic_store_n( &ARENAS_MAX_ALLOC, _max_alloc_find(  ), __ATOMIC_RELAXED );
+    }
+}
+
+/**
+ * @brief Pins malloc's mmap threshold, so the chunks above it are mapped as whole pages,
+ * and those below it come from the heap, whatever has been freed.
+ * @param bytes The threshold, glibc takes up to 32M on 64 bit.
+ * @details
+ * It is mallopt(M_MMAP_THRESHOLD), so it is the threshold of the whole process, and it
+ * turns glibc's dynamic threshold off.
+ * @return 0, or -1 with errno set to EINVAL, or ENOSYS without glibc.
+ */
+int arena_set_mmap_threshold( size_t bytes )
+{
+#ifdef __GLIBC__
+    if ( bytes == 0 || bytes > INT_MAX || !mallopt( M_MMAP_THRESHOLD, ( int ) bytes ) ) {
+        errno = EINVAL;
+        return -1;
+    }
+    mmap_threshold_pinned = true;
+    __atomic_store_n( &mmap_threshold, bytes, __ATOMIC_RELAXED );
+    return 0;
+#else
+    ( void ) bytes;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/** @brief Gets ARENAS_MAX_ALLOC. */
+size_t arena_get_max_alloc( void )
+{
+    return _max_alloc();
+}
+
+/** @brief Gets the header of a chunk, _AHS, and malloc's header of a block, malloc_hdr_sz. */
+void arena_get_chunk_header( size_t *chunk_hdr, size_t *malloc_hdr )
+{
+    *chunk_hdr = ( size_t ) _AHS;
+    *malloc_hdr = ( size_t ) malloc_hdr_sz;
+}
+
+/** @} */
+
+/**
+ * @defgroup AllocFuncs Allocation functions. 
+ * @{
+ */
+static inline void *_arena_alloc( size_t n, size_t mem_sz );
+
+/**
+ * @brief Allocates memory for an object from an arena.
+ * @param n The index of the arena to request memory from.
+ * @param mem_sz The amount of memory we want to allocate.
+ * @details
+ * Just calls  _alloc(), if there isn't enough memory left in the current chunk to satisfy
+ * the request, the fast path only touches the descriptor of the arena.
+ */
+
+void *arena_alloc( size_t n, size_t mem_sz )
+{
+    if ( _tracing(  ) ) {
+        _trace_event( ARENA_TRACE_ALLOC, n, mem_sz, 0 );
+    }
+    return _arena_alloc( n, mem_sz );
+}
+
+/**
+ * @brief The body of arena_alloc(), shared with arena_calloc(), so calls are traced once.
+ */
+static inline void *_arena_alloc( size_t n, size_t mem_sz )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+
+    static const char *emsg = "arena_alloc: Couldn't allocate memory for arena with mem_pd: %lu.\n" ;
+   // First reject anything nonsensical or excessively large .
     if ( mem_sz == 0 || mem_sz > PTRDIFF_MAX ) {
         return NULL; // request impossibly large (out of memory)
     }
 
-    void *p;
-    p = arenas[n]->begin; // start of buffer to allocate.
-    ptrdiff_t mem_pd = mem_sz;
-    ptrdiff_t padding = -mem_pd & ( MAX_ALIGN - 1 );
-    mem_pd += padding;
-    /// @todo first test below unneccessary?
-    if ( mem_pd < ( ptrdiff_t ) mem_sz || (  mem_pd   > (PTRDIFF_MAX - _AHS) ) ) {
-        fprintf( stderr, emsg, ( size_t ) mem_pd );
-        abort(  ); // Overflow conditions.
+    ArenaDesc *a = &descs[n];
+    ptrdiff_t mem_pd = mem_sz;
+    ptrdiff_t padding = -mem_pd & ( MAX_ALIGN - 1 );
+    mem_pd += padding;
+    /// @todo first test below unneccessary?
+    if ( mem_pd < ( ptrdiff_t ) mem_sz || (  mem_pd   > (PTRDIFF_MAX - _AHS) ) ) {
+        fprintf( stderr, emsg, ( size_t ) mem_pd );
+        abort(  ); // Overflow conditions.
+    }
+    void *p = a->begin; // start of buffer to allocate.
+    if ( mem_pd > a->end - a->begin ) {
+       // padding is already added to mem_pd here.
+        p = _alloc( a, mem_pd, n );
+        if ( !p ) {
+            return NULL;
+        }
+    } else {
+        a->begin += mem_pd;
+    }
+    a->requests += 1;
+    a->bytes_allocated += mem_sz;
+    a->bytes_padding += padding;
+    if ( mem_sz < a->min_request ) {
+        a->min_request = mem_sz;
+    }
+    if ( mem_sz > a->max_request ) {
+        a->max_request = mem_sz;
+    }
+    if ( a->hist ) {
+        a->hist->sizes[_hist_size_index( mem_sz )] += 1;
+    }
+
+    memset( p, 0, (size_t) mem_pd );
+    /* memset( p, 0, (size_t) (mem_pd + padding) ); */
+
+    return p; 
+}
+
+
+/**
+ * @brief Allocates memory for an array,zeroes it out.
+ * @param n The arena that is the "owner" of the allocation.
+ * @param nelem The number of elements in the array.
+ * @param mem_sz The size of the individual memoryry..
+ * @details
+ * Great for when you need fully initialized memory.
+ */
+void *arena_calloc( size_t n, size_t nelem, size_t mem_sz )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+
+    static const char *emsg = "arena_calloc: Couldn't allocate memory for array with mem_ll: %ld.\n"
+        "The request is larger than ARENAS_MAX_ALLOC: %lu. ";
+    static const char *emsg2 = "arena_calloc: Couldn't allocate memory for array with %ld nelem of size_t %ld.\n"
+        "The request is larger than ARENAS_MAX_ALLOC: %lu. ";
+    assert( mem_sz > 0 ) ;
+    long long mem_ll ;
+    if (nelem > -1ULL/mem_sz) {
+        fprintf( stderr, emsg2, (size_t) nelem, ( size_t ) mem_sz, _max_alloc() );
+        abort(  ); // Overflow conditions.
+    } else {
+        mem_ll = nelem * mem_sz;
+    }
+
+    if ( mem_ll <= 0 ) { // nelem was 0
+        return NULL;
+    } else if ( mem_ll > PTRDIFF_MAX ) {
+        fprintf( stderr, emsg, ( size_t ) mem_ll, _max_alloc());
+        abort(  ); // Overflow conditions.
+    } else if (mem_ll > (ssize_t)_max_alloc()) {
+        fprintf( stderr, emsg, ( size_t ) mem_ll, _max_alloc() );
+        abort(  ); // Overflow conditions.
+    } else {
+        if ( _tracing(  ) ) {
+            _trace_event( ARENA_TRACE_CALLOC, n, (size_t) mem_ll, 0 );
+        }
+        void *ptr = _arena_alloc( n, (size_t) mem_ll ); // Any logging of memory
+                                               // allocatations happens here!
+        return ptr;
+        /* return memset( ptr, 0, (size_t) mem_ll ); */
+    }
+}
+
+
+/**
+ * @brief Deallocate all objects from a lifetime, when their time is up, but retain the
+ * memory for the allocatation of a new set of objects in another lifetime.
+ * @param n The index of the arena to deallocate.
+ * @details
+ * The memory aren't freed from the arena, so it is available for quick reuse.
+ */
+void arena_dealloc( size_t n )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+    if ( _tracing(  ) ) {
+        _trace_event( ARENA_TRACE_DEALLOC, n, 0, 0 );
+    }
+    ArenaDesc *a = &descs[n];
+    _desc_claim( a );
+    size_t used = (size_t) ( a->bytes_allocated + a->bytes_padding - a->lifetime_mark );
+    if ( used > a->lifetime_peak ) {
+        a->lifetime_peak = used;
+        a->peak_padding = (size_t) ( a->bytes_padding - a->padding_mark );
+        a->peak_tail = (size_t) ( a->bytes_tail - a->tail_mark );
+    }
+    if ( a->hist ) {
+        a->hist->peaks[_hist_peak_index( used )] += 1;
+    }
+    if ( a->adapt_max ) {
+        _adapt( a, used );
+    }
+    a->refill_mark = a->refills;
+    a->lifetime_mark = a->bytes_allocated + a->bytes_padding;
+    a->padding_mark = a->bytes_padding;
+    a->tail_mark = a->bytes_tail;
+    a->lifetimes += 1;
+    if ( a->head ) {
+        Arena *left = a->cur;
+        _chunk_use( a, a->head );
+       // Works out beautifully with _alloc(),  which resets the retained chunks.
+        if ( a->map ) {
+            _map_mark( a, left );
+        }
+    }
+    unsigned epoch = __atomic_load_n( &trim_epoch, __ATOMIC_RELAXED );
+    if ( epoch != a->trim_mark ) { // Under memory pressure, keep only the head.
+        a->trim_mark = epoch;
+#ifdef __GLIBC__
+        if ( _trim( a ) ) {
+            malloc_trim( 0 );
+        }
+#else
+        _trim( a );
+#endif
+    }
+    if ( a->head ) {
+        _desc_park( a );
+    }
+}
+
+/**
+ * @brief Frees the chunks an arena has retained from earlier lifetimes, that the lifetime
+ * in progress hasn't got to.
+ * @param n The index of the arena.
+ * @details
+ * Right after arena_dealloc() that is all the chunks but the first.
+ * @return The bytes freed.
+ */
+size_t arena_trim( size_t n )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+    bool parked = _desc_claim( &descs[n] );
+    size_t freed = _trim( &descs[n] );
+    if ( parked ) {
+        _desc_park( &descs[n] );
+    }
+    return freed;
+}
+
+/** @} */
+
+/**
+ * @defgroup InitDeinit Initialization and destroy functions. 
+ * @{
+ */
+/**
+ * @brief Creates a ready to use arena, and configures the arena to support a chunk_sz.
+ * @param n The index of the arena to create.
+ * @param chunk_sz The nominal size of the arena to allocate memory from.
+ * @details
+ * Aborts if something is wrong.
+ */
+void arena_create( size_t n, size_t chunk_sz )
+{
+    arena_create_aligned( n, chunk_sz, 0 );
+}
+
+/**
+ * @brief Creates a ready to use arena, with the chunk headers kept out of band.
+ * @param n The index of the arena to create.
+ * @param chunk_sz The nominal size of the arena to allocate memory from.
+ * @param align The alignment of the start of the chunks, a power of two, at least
+ * MAX_ALIGN, typically CACHE_LINE_SIZE or the page size. 0 gives the layout of
+ * arena_create().
+ * @details
+ * The memory handed out from every chunk starts at the alignment, so the first object of
+ * a chunk lines up with a cache line or a page, and the chunk_sz is rounded up to a whole
+ * number of the alignment. Aborts if something is wrong.
+ *
+ * The budgets of arena_set_budget() are kept. An arena with budgets is created without a
+ * chunk when the first one would take it over its hard budget or ARENAS_MAX_ALLOC, and
+ * makes it at its first request, which returns NULL while it can't, instead of aborting.
+ */
+void arena_create_aligned( size_t n, size_t chunk_sz, size_t align )
+{
+    assert( arenas_initialized == true ) ;
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+
+    static const char *emsg = "arena_create: Couldn't allocate memory for arena with chunk_sz: %lu.\n";
+    /// @todo reuse error message as well.
+   // First reject anything nonsensical or excessively large .
+    if ( chunk_sz == 0 || chunk_sz > PTRDIFF_MAX ) {
+        fprintf( stderr, emsg, chunk_sz );
+        abort(  );
+    }
+
+    static const char *emsg2 = "arena_create_aligned: The alignment %lu is not a power of two >= MAX_ALIGN.\n";
+    if ( align && ( align < MAX_ALIGN || ( align & ( align - 1 ) ) || align > PTRDIFF_MAX ) ) {
+        fprintf( stderr, emsg2, align );
+        abort(  );
+    }
+    if ( descs[n].chunk_sz ) {
+        arena_destroy( n );
+    }
+   // The statistics count from here, the budgets stay.
+    ArenaDesc *a = &descs[n];
+    size_t soft = a->budget_soft, hard = a->budget_hard;
+    arena_budget_fn fn = a->budget_fn;
+    void *ctx = a->budget_ctx;
+    free( descs[n].hist );
+    memset( &descs[n], 0, sizeof descs[n] );
+    a->budget_soft = soft;
+    a->budget_hard = hard;
+    a->budget_fn = fn;
+    a->budget_ctx = ctx;
+    descs[n].min_request = SIZE_MAX;
+    descs[n].align = align;
+    descs[n].trim_mark = __atomic_load_n( &trim_epoch, __ATOMIC_RELAXED );
+
+    // default chunk_sz for each block for arena[n] adjusted for padding ;
+    if ( _arena_init( n, chunk_sz ) == NULL && !soft && !hard ) {
+        fprintf( stderr, emsg, chunk_sz );
+        abort(  );
+    }
+    if ( _tracing(  ) ) {
+        _trace_event( ARENA_TRACE_CREATE, n, chunk_sz, align ? ( unsigned ) __builtin_ctzll( align ) : 0 );
+    }
+}
+
+/**
+ * @brief Makes an arena adapt the chunk_sz of its new chunks to its lifetimes.
+ * @param n The index of the arena, after arena_create().
+ * @param min_chunk_sz The smallest chunk_sz to adapt to, like the chunk_sz of arena_create().
+ * @param max_chunk_sz The largest chunk_sz to adapt to, 0 turns adapting off, and keeps the
+ * chunk_sz the arena has adapted to.
+ * @details
+ * At every arena_dealloc() the chunk_sz is set for the peak of the lifetimes, so a lifetime
+ * is served from one or a few chunks, see _adapt(). Turning the histograms on with
+ * arena_histograms() makes it follow their percentiles instead of a decaying maximum.
+ * Chunks that were made for a larger chunk_sz than the current one are reported as
+ * oversized by arena_report_waste().
+ */
+void arena_set_adaptive( size_t n, size_t min_chunk_sz, size_t max_chunk_sz )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+    ArenaDesc *a = &descs[n];
+    if ( a->chunk_sz == 0 ) {
+        fprintf( stderr, msgNoArena, n );
+        abort(  );
+    }
+    if ( a->map ) {
+        fprintf( stderr, "arena_set_adaptive: Arena %lu is mapped, its chunks stay in its file.\n", n );
+        abort(  );
+    }
+    static const char *emsg = "arena_set_adaptive: The bounds %lu - %lu are out of range.\n";
+    if ( max_chunk_sz && ( min_chunk_sz < ( size_t ) ( malloc_hdr_sz + _AHS + MAX_ALIGN )
+                           || min_chunk_sz > max_chunk_sz
+                           || max_chunk_sz > _max_alloc() ) ) {
+        fprintf( stderr, emsg, min_chunk_sz, max_chunk_sz );
+        abort(  );
+    }
+    a->adapt_min = min_chunk_sz;
+    a->adapt_max = max_chunk_sz;
+    a->adapt_want = 0;
+}
+
+/**
+ * @brief Sets the budgets of the bytes malloc reserves for the chunks of an arena.
+ * @param n The index of the arena, before or after arena_create(), which keeps them.
+ * @param soft Crossing it calls fn, 0 for no soft budget.
+ * @param hard Requests that would take the arena over it return NULL with errno ENOMEM,
+ * and so do requests that would go over ARENAS_MAX_ALLOC, instead of aborting. 0 for no
+ * hard budget.
+ * @param fn Called with the arena, the bytes it would reserve and ctx, from the request that
+ * crosses the soft budget. It may shed load, trim arenas it owns, or grant more with
+ * arena_set_budget(), but must not allocate from the arena n.
+ * @param ctx Passed to fn.
+ * @details
+ * The budgets are checked when a chunk is malloc'ed, the chunks already reserved aren't
+ * freed. Both 0 takes the budgets off.
+ */
+void arena_set_budget( size_t n, size_t soft, size_t hard, arena_budget_fn fn, void *ctx )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+    ArenaDesc *a = &descs[n];
+    a->budget_soft = soft;
+    a->budget_hard = hard;
+    a->budget_fn = fn;
+    a->budget_ctx = ctx;
+    a->budget_fired = false;
+}
+
+/**
+ * @brief Destroys an arena frees all memory.
+ * @param n The index of the arena to destroy.
+ * @details
+ * All memory is released into the common pool of free memory.
+ *
+ */
+
+void arena_destroy( size_t n )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+
+    if ( _tracing(  ) ) {
+        _trace_event( ARENA_TRACE_DESTROY, n, 0, 0 );
+    }
+    ArenaDesc *a = &descs[n];
+    _desc_claim( a );
+    Arena *p = a->head,
+    *q;
+    struct mapping *m = a->map;
+    if ( m && p ) { // The file gets where we are, and is written back as the sync mode says.
+        _map_mark( a, NULL );
+        if ( m->sync != ARENA_SYNC_NONE ) {
+            msync( m->base, m->size, m->sync == ARENA_SYNC_WAIT ? MS_SYNC : MS_ASYNC );
+        }
+    }
+    a->begin = a->end = NULL;
+    a->cur = a->head = NULL;
+    for ( ; p; ) {
+        q = p->next;
+        _chunk_free( a, p );
+        p = q;
+    }
+    _ckpt_free( a );
+    if ( m ) {
+        munmap( m->base, ( size_t ) m->hdr->reserve );
+        close( m->fd );
+        free( m );
+        a->map = NULL;
+    } else {
+        __atomic_sub_fetch( &tot_mem_usage, a->mem_malloced + a->mem_mmapped, __ATOMIC_RELAXED );
+    }
+   // The statistics are kept for reporting.
+    a->chunk_sz = 0;
+    a->mem_malloced = a->mem_mmapped = 0;
+    a->bytes_oversized = a->oversized_chunks = 0;
+    a->chunks = 0;
+}
+
+/** @} */
+
+/**
+ * @defgroup MappedFuncs File backed arenas.
+ * @brief Arenas whose chunks are in a file mapped with MAP_SHARED, that can be mapped again
+ * by a later process.
+ * @details
+ * The file starts with a struct arena_file_header, and its table of the chunk chain, on
+ * whole pages, and the chunks follow in the order of the chain, page aligned, with their
+ * headers kept out of band like arena_create_aligned(). The reserve, the largest the file
+ * may grow to, is mapped at once, so the offsets from arena_mapped_base() never change,
+ * and neither do the addresses, when the file can be mapped where it was the last time.
+ * Where the arena allocates from is recorded in the header when it moves to another chunk,
+ * and by arena_sync(), arena_set_root(), arena_dealloc() and arena_destroy(), which is
+ * where a later process continues, after a crash too.
+ * @{
+ */
+
+/** The error message of the functions of a mapped arena used on another arena. */
+static const char *msgNotMapped = "%s: Arena %lu isn't created by arena_create_mapped().\n";
+
+/**
+ * @brief The file of arena n, aborts if it has none.
+ */
+static struct mapping *_mapped( size_t n, const char *fn )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+    if ( !descs[n].map ) {
+        fprintf( stderr, msgNotMapped, fn, n );
+        abort(  );
+    }
+    return descs[n].map;
+}
+
+/**
+ * @brief Reads and checks the header of a file made by arena_create_mapped().
+ * @return Whether it is one, made with our page size.
+ */
+static bool _map_header_ok( int fd, const struct stat *st, struct arena_file_header *h )
+{
+    if ( pread( fd, h, sizeof *h, 0 ) != ( ssize_t ) sizeof *h ) {
+        return false;
+    }
+    return !memcmp( h->magic, ARENA_FILE_MAGIC, sizeof h->magic ) && h->version == ARENA_FILE_VERSION
+           && h->page_sz == page_sz && h->hdr_sz % page_sz == 0 && h->reserve % page_sz == 0
+           && h->hdr_sz >= sizeof *h + h->max_chunks * sizeof h->chunk[0] && h->chunks <= h->max_chunks
+           && ( uint64_t ) st->st_size >= h->hdr_sz && ( uint64_t ) st->st_size <= h->reserve
+           && h->reserve <= PTRDIFF_MAX;
+}
+
+/**
+ * @brief Creates an arena whose chunks are in the file path, or opens it again.
+ * @param n The index of the arena to create.
+ * @param path The file, created if it doesn't exist, or empty.
+ * @param chunk_sz The nominal size of the chunks, rounded up to whole pages.
+ * @param reserve The largest the file may grow to, the address space reserved for it. A
+ * file that is opened again keeps the reserve it was made with.
+ * @param sync ARENA_SYNC_NONE leaves the writing back to the kernel, ARENA_SYNC_ASYNC starts
+ * it for every chunk the arena moves on from, and at arena_destroy(), and ARENA_SYNC_WAIT
+ * waits for it too.
+ * @details
+ * A file that is opened again has the chunks, the root and the allocations it had when it
+ * was last marked, see the group, and the arena continues from there. The file isn't
+ * locked, only one process should have it open. The budgets, arena_dealloc() and
+ * arena_destroy() work as with any arena, except that the file stays, and
+ * arena_set_adaptive() isn't for mapped arenas, the chunks can't be freed from the middle
+ * of the file.
+ * @return 0, or -1 with errno set, EINVAL for a file that isn't an arena file, or the
+ * sizes don't fit.
+ */
+int arena_create_mapped( size_t n, const char *path, size_t chunk_sz, size_t reserve, int sync )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+    size_t chunk_pd = ( chunk_sz + page_sz - 1 ) & -page_sz;
+    if ( chunk_sz == 0 || chunk_sz > PTRDIFF_MAX / 2 || reserve > PTRDIFF_MAX - page_sz
+         || sync < ARENA_SYNC_NONE || sync > ARENA_SYNC_WAIT ) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+    if ( fd < 0 ) {
+        return -1;
+    }
+    struct arena_file_header h = { .version = ARENA_FILE_VERSION };
+    struct stat st;
+    struct mapping *m = NULL;
+    if ( fstat( fd, &st ) ) {
+        goto fail;
+    }
+    bool reopen = st.st_size > 0;
+    if ( reopen ) {
+        if ( !_map_header_ok( fd, &st, &h ) ) {
+            errno = EINVAL;
+            goto fail;
+        }
+    } else {
+        memcpy( h.magic, ARENA_FILE_MAGIC, sizeof h.magic );
+        h.page_sz = ( uint32_t ) page_sz;
+        h.reserve = ( reserve + page_sz - 1 ) & -page_sz;
+        h.max_chunks = h.reserve / chunk_pd + 1;
+        h.hdr_sz = ( sizeof h + h.max_chunks * sizeof h.chunk[0] + page_sz - 1 ) & -page_sz;
+        if ( h.hdr_sz + chunk_pd > h.reserve ) {
+            errno = EINVAL;
+            goto fail;
+        }
+        if ( ftruncate( fd, ( off_t ) h.hdr_sz ) ) {
+            goto fail;
+        }
+    }
+    if ( !( m = malloc( sizeof *m ) ) ) {
+        goto fail;
+    }
+   // Where it was the last time, if the address is free, so the pointers in it hold too.
+    void *base = mmap( ( void * ) ( uintptr_t ) h.base, ( size_t ) h.reserve, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( base == MAP_FAILED ) {
+        goto fail;
+    }
+    *m = ( struct mapping ) { .base = base, .hdr = base, .size = ( size_t ) h.hdr_sz, .fd = fd, .sync = sync };
+    if ( !reopen ) {
+        *m->hdr = h;
+    }
+   // The chunks of the table must follow each other in the file, as _map_chunk() takes them.
+    uint64_t end = h.hdr_sz;
+    for ( size_t i = 0; i < h.chunks; end += m->hdr->chunk[i++].size ) {
+        if ( m->hdr->chunk[i].offset != end || m->hdr->chunk[i].size % page_sz
+             || m->hdr->chunk[i].size > ( uint64_t ) st.st_size - end ) {
+            munmap( base, ( size_t ) h.reserve );
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+    m->hdr->base = ( uint64_t ) ( uintptr_t ) base;
+
+    if ( descs[n].head ) {
+        arena_destroy( n );
+    }
+   // The statistics count from here.
+    ArenaDesc *a = &descs[n];
+    free( a->hist );
+    memset( a, 0, sizeof *a );
+    a->min_request = SIZE_MAX;
+    a->align = page_sz;
+    a->trim_mark = __atomic_load_n( &trim_epoch, __ATOMIC_RELAXED );
+    a->map = m;
+    a->chunk_sz = chunk_pd;
+
+    Arena *tail = NULL, *cur = NULL;
+    for ( size_t i = 0; i < m->hdr->chunks || !tail; ++i ) {
+        Arena *ap = _chunk_new( a, tail, i < m->hdr->chunks ? ( ptrdiff_t ) m->hdr->chunk[i].size : ( ptrdiff_t ) chunk_pd );
+        if ( !ap ) {
+            int saved_errno = errno;
+            arena_destroy( n );
+            errno = saved_errno;
+            return -1;
+        }
+        if ( ( uint64_t ) ( ap->base - m->base ) == m->hdr->cur ) {
+            cur = ap;
+        }
+        tail = ap;
+    }
+    _chunk_use( a, cur ? cur : a->head );
+    char *begin = m->base + m->hdr->begin;
+    if ( cur && begin >= cur->base && begin <= cur->end ) {
+        a->begin = begin;
+    }
+    _map_mark( a, NULL );
+    if ( _tracing(  ) ) {
+        _trace_event( ARENA_TRACE_CREATE, n, chunk_sz, ( unsigned ) __builtin_ctzll( page_sz ) );
+    }
+    return 0;
+fail:
+    {
+        int saved_errno = errno;
+        free( m );
+        close( fd );
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+/**
+ * @brief Makes p the root of a mapped arena, the object a later process finds with
+ * arena_root(), and records where the arena allocates from with it.
+ * @param n The index of the arena.
+ * @param p An object in the arena, or NULL for none.
+ */
+void arena_set_root( size_t n, void *p )
+{
+    struct mapping *m = _mapped( n, "arena_set_root" );
+    if ( p && ( ( char * ) p < m->base + m->hdr->hdr_sz || ( char * ) p >= m->base + m->size ) ) {
+        fprintf( stderr, "arena_set_root: %p isn't in arena %lu.\n", p, n );
+        abort(  );
+    }
+    m->hdr->root = p ? ( uint64_t ) ( ( char * ) p - m->base ) : 0;
+    _map_mark( &descs[n], NULL );
+}
+
+/**
+ * @brief The root of a mapped arena, set by arena_set_root() in this process or an earlier
+ * one, or NULL when there is none, as in a new file.
+ */
+void *arena_root( size_t n )
+{
+    struct mapping *m = _mapped( n, "arena_root" );
+    return m->hdr->root ? m->base + m->hdr->root : NULL;
+}
+
+/**
+ * @brief Where the file of a mapped arena is mapped, the offsets of the objects from it are
+ * the same in every process that maps the file.
+ */
+void *arena_mapped_base( size_t n )
+{
+    return _mapped( n, "arena_mapped_base" )->base;
+}
+
+/**
+ * @brief Records where a mapped arena allocates from, and writes the file back.
+ * @param n The index of the arena.
+ * @param mode ARENA_SYNC_WAIT returns when the file is on disk, ARENA_SYNC_ASYNC when it is
+ * scheduled, and ARENA_SYNC_NONE only records it, for the kernel to write back.
+ * @return 0, or -1 with errno set by msync().
+ */
+int arena_sync( size_t n, int mode )
+{
+    struct mapping *m = _mapped( n, "arena_sync" );
+    _map_mark( &descs[n], NULL );
+    if ( mode == ARENA_SYNC_NONE ) {
+        return 0;
+    }
+    return msync( m->base, m->size, mode == ARENA_SYNC_WAIT ? MS_SYNC : MS_ASYNC );
+}
+
+/** @} */
+
+/**
+ * @defgroup ImageFuncs Relocatable snapshots.
+ * @brief Images of what an arena holds, that are mapped read-only anywhere, and used as
+ * they are.
+ * @details
+ * An image is a struct arena_image_header, its table of the chunks, and the part of every
+ * chunk the lifetime in progress has handed out, in the order of the chain. The pointers
+ * in it must be self-relative, see ARENA_REL_STORE(), so they hold wherever the image is
+ * mapped. A chunk keeps its layout in the image, aligned like the arena up to a page, so
+ * the pointers within a chunk hold, and so do the pointers between the chunks of a mapped
+ * arena, which are contiguous in the image as in the file. Between the chunks of other
+ * arenas they don't, so an arena to be snapshot is best sized, or adapted, to hold the
+ * structure in one chunk.
+ * @{
+ */
+
+/** The number of iovecs arena_snapshot() writes at a time. */
+#define SNAPSHOT_IOV 64
+
+/**
+ * @brief Writes the iovecs, all of them, or fails.
+ * @return 0, or -1 with errno set.
+ */
+static int _writev_all( int fd, struct iovec *iov, int cnt )
+{
+    while ( cnt > 0 ) {
+        ssize_t done = writev( fd, iov, cnt );
+        if ( done < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        for ( ; cnt > 0 && ( size_t ) done >= iov->iov_len; --cnt, ++iov ) {
+            done -= ( ssize_t ) iov->iov_len;
+        }
+        if ( cnt > 0 ) { // A short write, go on from where it stopped.
+            iov->iov_base = ( char * ) iov->iov_base + done;
+            iov->iov_len -= ( size_t ) done;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Lays out the image of what arena n holds, in a header with its chunk table.
+ * @param hdr_sz Gets the bytes of the header, whole pages, which is where the chunks start.
+ * @return The header, malloc'ed, or NULL with errno set.
+ */
+static struct arena_image_header *_image_header( size_t n, size_t *hdr_sz )
+{
+    ArenaDesc *a = &descs[n];
+    size_t align = a->align < MAX_ALIGN ? MAX_ALIGN : a->align > page_sz ? page_sz : a->align;
+    size_t chunks = 0;
+    for ( Arena *ap = a->head; ap; ap = ap->next ) {
+        ++chunks;
+        if ( ap == a->cur ) {
+            break;
+        }
+    }
+    *hdr_sz = ( sizeof( struct arena_image_header ) + chunks * sizeof( struct arena_file_chunk ) + page_sz - 1 ) & -page_sz;
+    struct arena_image_header *h = calloc( 1, *hdr_sz );
+    if ( !h ) {
+        return NULL;
+    }
+    memcpy( h->magic, ARENA_IMAGE_MAGIC, sizeof h->magic );
+    h->version = ARENA_IMAGE_VERSION;
+    h->align = ( uint32_t ) align;
+    h->chunks = chunks;
+    char *root = a->map ? arena_root( n ) : NULL;
+    uint64_t size = *hdr_sz;
+    size_t i = 0;
+    for ( Arena *ap = a->head; i < chunks; ap = ap->next, ++i ) {
+        char *end = ap == a->cur ? a->begin : ap->end;
+        size = ( size + align - 1 ) & -( uint64_t ) align;
+        h->chunk[i].offset = size;
+        h->chunk[i].size = ( uint64_t ) ( end - ap->base );
+        if ( a->map ? root && root >= ap->base && root < end : !h->root && end > ap->base ) {
+            h->root = size + ( uint64_t ) ( ( a->map ? root : ap->base ) - ap->base );
+        }
+        size += h->chunk[i].size;
+    }
+    h->size = size;
+    return h;
+}
+
+/**
+ * @brief Writes an image of what arena n holds to fd, with writev().
+ * @param n The index of the arena.
+ * @param fd Where the image is written, from its current offset, which should be the start
+ * of the file for arena_load().
+ * @details
+ * The image holds the chunks from the head up to where the arena allocates now, that is
+ * what the lifetime in progress has handed out. Its root is the root of a mapped arena,
+ * see arena_set_root(), and otherwise the first object allocated in the lifetime.
+ * @return 0, or -1 with errno set.
+ */
+int arena_snapshot( size_t n, int fd )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+    ArenaDesc *a = &descs[n];
+    if ( a->chunk_sz == 0 ) {
+        fprintf( stderr, msgNoArena, n );
+        abort(  );
+    }
+    size_t hdr_sz;
+    bool parked = _desc_claim( a );
+    struct arena_image_header *h = _image_header( n, &hdr_sz );
+    char *zeros = calloc( 1, page_sz );
+    if ( !h || !zeros ) {
+        free( h );
+        free( zeros );
+        if ( parked ) {
+            _desc_park( a );
+        }
+        return -1;
+    }
+
+    struct iovec iov[SNAPSHOT_IOV];
+    int cnt = 0, err = 0;
+    iov[cnt++] = ( struct iovec ) { h, hdr_sz };
+    uint64_t size = hdr_sz;
+    size_t i = 0;
+    for ( Arena *ap = a->head; i < h->chunks && !err; ap = ap->next, ++i ) {
+        if ( cnt > SNAPSHOT_IOV - 2 ) {
+            err = _writev_all( fd, iov, cnt );
+            cnt = 0;
+        }
+        if ( h->chunk[i].offset > size ) {
+            iov[cnt++] = ( struct iovec ) { zeros, ( size_t ) ( h->chunk[i].offset - size ) };
+        }
+        iov[cnt++] = ( struct iovec ) { ap->base, ( size_t ) h->chunk[i].size };
+        size = h->chunk[i].offset + h->chunk[i].size;
+    }
+    if ( !err ) {
+        err = _writev_all( fd, iov, cnt );
+    }
+    int saved_errno = errno;
+    free( h );
+    free( zeros );
+    if ( parked ) {
+        _desc_park( a );
+    }
+    errno = saved_errno;
+    return err;
+}
+
+/**
+ * @brief Maps an image written by arena_snapshot() read-only, as it is.
+ * @param fd The file of the image, which starts at offset 0.
+ * @param img Gets the mapping, and the root.
+ * @details
+ * Nothing is read but the header, the pages of the image are faulted in as the structure
+ * is used, and are shared by every process that maps the file.
+ * @return 0, or -1 with errno set, EINVAL if it isn't an image.
+ */
+int arena_load( int fd, struct arena_image *img )
+{
+    struct arena_image_header h;
+    struct stat st;
+    if ( fstat( fd, &st ) ) {
+        return -1;
+    }
+    if ( pread( fd, &h, sizeof h, 0 ) != ( ssize_t ) sizeof h
+         || memcmp( h.magic, ARENA_IMAGE_MAGIC, sizeof h.magic ) || h.version != ARENA_IMAGE_VERSION
+         || h.size < sizeof h || h.size > ( uint64_t ) st.st_size || h.size > PTRDIFF_MAX || h.root >= h.size
+         || h.chunks > ( h.size - sizeof h ) / sizeof h.chunk[0] ) {
+        errno = EINVAL;
+        return -1;
+    }
+    void *base = mmap( NULL, ( size_t ) h.size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( base == MAP_FAILED ) {
+        return -1;
+    }
+    const struct arena_image_header *mh = base;
+    for ( uint64_t i = 0; i < mh->chunks; ++i ) {
+        if ( mh->chunk[i].offset > h.size || mh->chunk[i].size > h.size - mh->chunk[i].offset ) {
+            munmap( base, ( size_t ) h.size );
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    img->base = base;
+    img->size = ( size_t ) h.size;
+    img->root = h.root ? ( char * ) base + h.root : NULL;
+    return 0;
+}
+
+/**
+ * @brief Unmaps an image mapped by arena_load().
+ */
+void arena_unload( struct arena_image *img )
+{
+    if ( img->base ) {
+        munmap( img->base, img->size );
+    }
+    img->base = img->root = NULL;
+    img->size = 0;
+}
+
+/** @} */
+
+/**
+ * @defgroup CheckpointFuncs Incremental checkpoints.
+ * @brief Checkpoints of an arena that write the chunks written since the last one.
+ * @details
+ * A checkpoint is the file dir/chunks.<seq> with the chunks that are dirty, one after the
+ * other, and dir/manifest, with the header of the image arena_snapshot() would write, and
+ * for every chunk the checkpoint whose file has it, and where. The manifest is written to
+ * a temporary file and renamed over the last one, so a crash leaves the last checkpoint,
+ * and the chunk files it no longer refers to are removed after. The I/O is the dirty
+ * chunks, the write rate, and not the size of the arena.
+ *
+ * The arena doesn't see the writes to the objects it has handed out, so a chunk is dirty
+ * when something has been allocated in it since, or arena_mark_dirty() says so, or, with
+ * arena_soft_dirty(), when the kernel's soft dirty bits say a page of it has been written.
+ * @{
+ */
+
+/** The longest path of the files of the checkpoints. */
+#define CKPT_PATH_SIZE 4096
+
+/**
+ * @brief Formats the path of a file in the directory of the checkpoints.
+ * @return Whether it fits, errno is ENAMETOOLONG if not.
+ */
+static bool _ckpt_path( char *path, const char *dir, const char *name, uint64_t seq )
+{
+    int len = seq ? snprintf( path, CKPT_PATH_SIZE, "%s/%s.%llu", dir, name, ( unsigned long long ) seq )
+                  : snprintf( path, CKPT_PATH_SIZE, "%s/%s", dir, name );
+    if ( len < 0 || len >= CKPT_PATH_SIZE ) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads and checks dir/manifest.
+ * @param ih Gets the header of the image in it.
+ * @param mc Gets the table of where its chunks are.
+ * @return The manifest, malloc'ed, with mh at its start, or NULL with errno set, EINVAL
+ * when it isn't a manifest.
+ */
+static struct arena_manifest_header *_manifest_read( const char *dir, struct arena_image_header **ih,
+                                                     struct arena_manifest_chunk **mc )
+{
+    char path[CKPT_PATH_SIZE];
+    struct stat st;
+    if ( !_ckpt_path( path, dir, "manifest", 0 ) ) {
+        return NULL;
+    }
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if ( fd < 0 ) {
+        return NULL;
+    }
+    struct arena_manifest_header *mh = NULL;
+    if ( fstat( fd, &st ) || !( mh = malloc( st.st_size ? ( size_t ) st.st_size : 1 ) ) ) {
+        goto fail;
+    }
+    if ( pread( fd, mh, ( size_t ) st.st_size, 0 ) != st.st_size || ( size_t ) st.st_size < sizeof *mh + sizeof **ih
+         || memcmp( mh->magic, ARENA_MANIFEST_MAGIC, sizeof mh->magic ) || mh->version != ARENA_MANIFEST_VERSION ) {
+        errno = EINVAL;
+        goto fail;
+    }
+    *ih = ( struct arena_image_header * ) ( mh + 1 );
+    uint64_t chunks = ( *ih )->chunks, img_sz = sizeof **ih + chunks * sizeof( struct arena_file_chunk );
+    if ( memcmp( ( *ih )->magic, ARENA_IMAGE_MAGIC, sizeof ( *ih )->magic ) || ( *ih )->version != ARENA_IMAGE_VERSION
+         || chunks > ( uint64_t ) st.st_size / sizeof( struct arena_manifest_chunk ) || mh->img_sz != img_sz
+         || sizeof *mh + img_sz + chunks * sizeof **mc != ( uint64_t ) st.st_size ) {
+        errno = EINVAL;
+        goto fail;
+    }
+    *mc = ( struct arena_manifest_chunk * ) ( ( char * ) *ih + img_sz );
+    close( fd );
+    return mh;
+fail:
+    {
+        int saved_errno = errno;
+        free( mh );
+        close( fd );
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+/**
+ * @brief The checkpoint state of an arena, made, or made again for another directory.
+ * @details
+ * A new state takes the sequence number from a manifest already in dir, and remembers its
+ * chunk files, to remove them when they are replaced, so the first checkpoint writes all
+ * the chunks.
+ */
+static struct checkpoint *_ckpt_state( ArenaDesc *a, const char *dir )
+{
+    struct checkpoint *ck = a->ckpt;
+    if ( ck && ck->dir && !strcmp( ck->dir, dir ) ) {
+        return ck;
+    }
+    if ( !ck ) {
+        if ( !( ck = calloc( 1, sizeof *ck ) ) ) {
+            return NULL;
+        }
+        ck->pagemap = -1;
+        a->ckpt = ck;
+    }
+    char *copy = malloc( strlen( dir ) + 1 );
+    if ( !copy ) {
+        return NULL;
+    }
+    free( ck->dir );
+    free( ck->stale );
+    ck->dir = strcpy( copy, dir );
+    ck->seq = 0;
+    ck->chunks = 0;
+    ck->stale = NULL;
+    ck->nstale = 0;
+    struct arena_image_header *ih;
+    struct arena_manifest_chunk *mc;
+    struct arena_manifest_header *mh = _manifest_read( dir, &ih, &mc );
+    if ( mh ) {
+        ck->seq = mh->seq;
+        if ( ( ck->stale = malloc( ( ih->chunks ? ih->chunks : 1 ) * sizeof *ck->stale ) ) ) {
+            for ( uint64_t i = 0; i < ih->chunks; ++i ) {
+                ck->stale[ck->nstale++] = mc[i].gen;
+            }
+        }
+        free( mh );
+    }
+    return ck;
+}
+
+/**
+ * @brief Whether the soft dirty bit of a page of [base, base + len) is set.
+ * @details
+ * Bit 55 of the entries of /proc/self/pagemap, set when a page is written after
+ * /proc/self/clear_refs was written with 4. A pagemap that can't be read says dirty.
+ */
+static bool _soft_dirty( int pagemap, const char *base, uint64_t len )
+{
+    uint64_t entries[512];
+    uintptr_t page = ( uintptr_t ) base / page_sz, last = ( ( uintptr_t ) base + len + page_sz - 1 ) / page_sz;
+    while ( page < last ) {
+        size_t cnt = last - page < 512 ? ( size_t ) ( last - page ) : 512;
+        ssize_t got = pread( pagemap, entries, cnt * sizeof *entries, ( off_t ) ( page * sizeof *entries ) );
+        if ( got <= 0 ) {
+            return true;
+        }
+        cnt = ( size_t ) got / sizeof *entries;
+        for ( size_t i = 0; i < cnt; ++i ) {
+            if ( entries[i] >> 55 & 1 ) {
+                return true;
+            }
+        }
+        page += cnt;
+    }
+    return false;
+}
+
+/** Clears the soft dirty bits of the process, returns false if the kernel can't. */
+static bool _soft_dirty_clear( void )
+{
+    int fd = open( "/proc/self/clear_refs", O_WRONLY | O_CLOEXEC );
+    if ( fd < 0 ) {
+        return false;
+    }
+    bool ok = write( fd, "4", 1 ) == 1;
+    close( fd );
+    return ok;
+}
+
+/** The descriptor of arena n, aborts if it isn't created. */
+static ArenaDesc *_ckpt_desc( size_t n )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
+        abort(  ); // Overflow conditions.
+    }
+    if ( descs[n].chunk_sz == 0 ) {
+        fprintf( stderr, msgNoArena, n );
+        abort(  );
+    }
+    return &descs[n];
+}
+
+/**
+ * @brief Writes a checkpoint of arena n to the directory dir, with the chunks that are
+ * dirty since the last one.
+ * @param n The index of the arena.
+ * @param dir An existing directory, for this arena only. The first checkpoint into it in a
+ * process writes all the chunks, and so does one after the arena has been destroyed.
+ * @details
+ * The chunks are the ones arena_snapshot() writes, and arena_checkpoint_restore() makes its
+ * image from the manifest. The files are synced before the manifest is renamed, and the
+ * directory after.
+ * @return 0, or -1 with errno set, and the last checkpoint stands.
+ */
+int arena_checkpoint( size_t n, const char *dir )
+{
+    ArenaDesc *a = _ckpt_desc( n );
+    bool parked = _desc_claim( a );
+    size_t hdr_sz;
+    struct checkpoint *ck = _ckpt_state( a, dir );
+    struct arena_image_header *h = ck ? _image_header( n, &hdr_sz ) : NULL;
+    struct arena_manifest_chunk *mc = h ? calloc( h->chunks ? h->chunks : 1, sizeof *mc ) : NULL;
+    struct ckpt_chunk *next = mc ? calloc( h->chunks ? h->chunks : 1, sizeof *next ) : NULL;
+    uint64_t *stale = next ? malloc( ( ck->chunks + ck->nstale + 1 ) * sizeof *stale ) : NULL;
+    char path[CKPT_PATH_SIZE], tmp[CKPT_PATH_SIZE];
+    int fd = -1, err = -1;
+    bool cleared = false; // The soft dirty bits, then a failed checkpoint can't be followed.
+    if ( !stale ) {
+        goto out;
+    }
+    uint64_t seq = ck->seq + 1, offset = 0;
+    bool fresh = a->lifetimes != ck->lifetimes || ck->full;
+    size_t i = 0, dirty = 0;
+    for ( Arena *ap = a->head; i < h->chunks; ap = ap->next, ++i ) {
+        uint64_t size = h->chunk[i].size;
+        const struct ckpt_chunk *was = i < ck->chunks ? &ck->chunk[i] : NULL;
+        if ( !was || fresh || was->dirty || was->base != ap->base || was->size != size
+             || ( ck->pagemap >= 0 && _soft_dirty( ck->pagemap, ap->base, size ) ) ) {
+            next[i] = ( struct ckpt_chunk ) { ap->base, size, seq, offset, false };
+            offset += size;
+            dirty += size ? 1 : 0;
+        } else {
+            next[i] = *was;
+        }
+        mc[i].gen = next[i].gen;
+        mc[i].offset = next[i].offset;
+    }
+   // Writes from here on are in the next checkpoint, or in this one too.
+    if ( ck->pagemap >= 0 && !_soft_dirty_clear(  ) ) {
+        goto out;
+    }
+    cleared = ck->pagemap >= 0;
+
+    if ( dirty ) {
+        if ( !_ckpt_path( path, dir, "chunks", seq )
+             || ( fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) < 0 ) {
+            goto out;
+        }
+        struct iovec iov[SNAPSHOT_IOV];
+        int cnt = 0;
+        i = 0;
+        for ( Arena *ap = a->head; i < h->chunks; ap = ap->next, ++i ) {
+            if ( next[i].gen != seq || !next[i].size ) {
+                continue;
+            }
+            if ( cnt == SNAPSHOT_IOV ) {
+                if ( _writev_all( fd, iov, cnt ) ) {
+                    goto out;
+                }
+                cnt = 0;
+            }
+            iov[cnt++] = ( struct iovec ) { ap->base, ( size_t ) next[i].size };
+        }
+        if ( _writev_all( fd, iov, cnt ) || fsync( fd ) ) {
+            goto out;
+        }
+        close( fd );
+        fd = -1;
+    }
+
+    struct arena_manifest_header mh = { .version = ARENA_MANIFEST_VERSION, .seq = seq };
+    memcpy( mh.magic, ARENA_MANIFEST_MAGIC, sizeof mh.magic );
+    mh.img_sz = sizeof *h + h->chunks * sizeof h->chunk[0];
+    struct iovec iov[3] = { { &mh, sizeof mh }, { h, ( size_t ) mh.img_sz }, { mc, ( size_t ) h->chunks * sizeof *mc } };
+    if ( !_ckpt_path( path, dir, "manifest", 0 ) || !_ckpt_path( tmp, dir, "manifest.tmp", 0 )
+         || ( fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 ) ) < 0 ) {
+        goto out;
+    }
+    if ( _writev_all( fd, iov, 3 ) || fsync( fd ) || rename( tmp, path ) ) {
+        goto out;
+    }
+    close( fd );
+    fd = -1;
+    if ( ( fd = open( dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC ) ) >= 0 ) {
+        fsync( fd );
+    }
+
+   // The chunk files the manifest no longer refers to.
+    size_t nstale = 0;
+    for ( i = 0; i < ck->chunks + ck->nstale; ++i ) {
+        uint64_t gen = i < ck->chunks ? ck->chunk[i].gen : ck->stale[i - ck->chunks];
+        bool used = gen == seq;
+        for ( size_t j = 0; j < h->chunks && !used; ++j ) {
+            used = next[j].gen == gen;
+        }
+        for ( size_t j = 0; j < nstale && !used; ++j ) {
+            used = stale[j] == gen;
+        }
+        if ( !used ) {
+            stale[nstale++] = gen;
+            if ( _ckpt_path( path, dir, "chunks", gen ) ) {
+                unlink( path );
+            }
+        }
+    }
+    free( ck->chunk );
+    free( ck->stale );
+    ck->chunk = next;
+    ck->chunks = ( size_t ) h->chunks;
+    ck->stale = NULL;
+    ck->nstale = 0;
+    ck->seq = seq;
+    ck->lifetimes = a->lifetimes;
+    ck->full = false;
+    next = NULL;
+    err = 0;
+out:
+    {
+        int saved_errno = errno;
+        if ( fd >= 0 ) {
+            close( fd );
+        }
+        if ( err && cleared ) {
+           // The next checkpoint writes everything, the chunks of the last one are still
+           // what its manifest refers to.
+            ck->full = true;
+        }
+        free( h );
+        free( mc );
+        free( next );
+        free( stale );
+        if ( parked ) {
+            _desc_park( a );
+        }
+        errno = saved_errno;
+    }
+    return err;
+}
+
+/**
+ * @brief Marks the chunk of arena n that p is in dirty, for an object that is written in
+ * place, so the next checkpoint writes it.
+ * @details
+ * Walks the chain, it is for objects that are changed after the checkpoint they were
+ * allocated before. Nothing to do before the first checkpoint, which writes everything.
+ */
+void arena_mark_dirty( size_t n, const void *p )
+{
+    ArenaDesc *a = _ckpt_desc( n );
+    struct checkpoint *ck = a->ckpt;
+    if ( !ck ) {
+        return;
+    }
+    bool parked = _desc_claim( a );
+    size_t i = 0;
+    for ( Arena *ap = a->head; ap && i < ck->chunks; ap = ap->next, ++i ) {
+        if ( ( const char * ) p >= ap->base && ( const char * ) p < ap->end ) {
+            ck->chunk[i].dirty = true;
+            break;
+        }
+    }
+    if ( parked ) {
+        _desc_park( a );
+    }
+}
+
+/**
+ * @brief Turns finding the chunks written in place with the kernel's soft dirty bits on or
+ * off for the checkpoints of arena n.
+ * @details
+ * The bits are cleared for the whole process at every checkpoint, so it is for the
+ * checkpoints of one arena, and for a process that doesn't use them for anything else. The
+ * first checkpoint after it is turned on writes everything.
+ * @return 0, or -1 with errno set, EOPNOTSUPP when the kernel has no soft dirty bits.
+ */
+int arena_soft_dirty( size_t n, bool on )
+{
+    ArenaDesc *a = _ckpt_desc( n );
+    struct checkpoint *ck = a->ckpt;
+    if ( !ck ) {
+        if ( !on ) {
+            return 0;
+        }
+        if ( !( ck = calloc( 1, sizeof *ck ) ) ) {
+            return -1;
+        }
+        ck->pagemap = -1;
+        a->ckpt = ck;
+    }
+    if ( ck->pagemap >= 0 ) {
+        close( ck->pagemap );
+        ck->pagemap = -1;
+    }
+    if ( on ) {
+        if ( !_soft_dirty_clear(  ) || ( ck->pagemap = open( "/proc/self/pagemap", O_RDONLY | O_CLOEXEC ) ) < 0 ) {
+            return -1;
+        }
+       // A kernel without CONFIG_MEM_SOFT_DIRTY takes the clear, and never sets the bits.
+        volatile char *probe;
+        if ( posix_memalign( ( void ** ) &probe, page_sz, page_sz ) ) {
+            return -1;
+        }
+        probe[0] = 1;
+        bool works = _soft_dirty( ck->pagemap, ( const char * ) probe, 1 );
+        free( ( void * ) probe );
+        if ( !works ) {
+            close( ck->pagemap );
+            ck->pagemap = -1;
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        ck->full = true;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the image of the last checkpoint in dir to fd, as arena_snapshot() would
+ * have written it then, for arena_load().
+ * @param dir The directory of the checkpoints.
+ * @param fd Where the image is written, from its current offset.
+ * @return 0, or -1 with errno set.
+ */
+int arena_checkpoint_restore( const char *dir, int fd )
+{
+    struct arena_image_header *ih;
+    struct arena_manifest_chunk *mc;
+    struct arena_manifest_header *mh = _manifest_read( dir, &ih, &mc );
+    char *buf = mh ? calloc( 1, 1 << 16 ) : NULL;
+    char path[CKPT_PATH_SIZE];
+    int in = -1, err = -1;
+    uint64_t in_gen = 0, at = mh ? mh->img_sz : 0;
+    if ( !buf || _writev_all( fd, &( struct iovec ) { ih, ( size_t ) mh->img_sz }, 1 ) ) {
+        goto out;
     }
-    ptrdiff_t gauge = (ptrdiff_t)arenas[n]->begin + mem_pd ;
-    assert( gauge >= 0) ;
-    if ( gauge  > (ptrdiff_t) arenas[n]->end ) {
-       // padding is already added to mem_pd here.
-        p = _alloc( &arenas[n], mem_pd, n );
-    } else { // zero out last byte and padding
-#if 0
-        ptrdiff_t padding2 = arenas[n]->begin ;
-           padding2 = -padding2 & ( MAX_ALIGN - 1 );
-           arenas[n]->begin += padding2;
-#endif 
-        arenas[n]->begin += (mem_pd + padding);
-#if 0
-        for ( char *zptr = arenas[n]->begin - ( padding + 1 ); zptr < arenas[n]->begin; zptr++ ) {
-            *zptr = '\0';
-        }
-#endif 
-    }
-
-#if ARENAS_LOG_LEVEL > 1
-    allocated_memory[n] += mem_sz;
-    allocation_memory_count[n] += 1;
-#endif
+    for ( uint64_t i = 0; i < ih->chunks; ++i ) {
+        uint64_t size = ih->chunk[i].size, from = mc[i].offset;
+       // The zeros in front of the chunk.
+        for ( memset( buf, 0, 1 << 16 ); at < ih->chunk[i].offset; ) {
+            size_t len = ih->chunk[i].offset - at < 1 << 16 ? ( size_t ) ( ih->chunk[i].offset - at ) : 1 << 16;
+            if ( _writev_all( fd, &( struct iovec ) { buf, len }, 1 ) ) {
+                goto out;
+            }
+            at += len;
+        }
+        if ( size && in_gen != mc[i].gen ) {
+            if ( in >= 0 ) {
+                close( in );
+            }
+            in_gen = mc[i].gen;
+            if ( !_ckpt_path( path, dir, "chunks", in_gen ) || ( in = open( path, O_RDONLY | O_CLOEXEC ) ) < 0 ) {
+                goto out;
+            }
+        }
+        while ( size ) {
+            ssize_t got = pread( in, buf, size < 1 << 16 ? ( size_t ) size : 1 << 16, ( off_t ) from );
+            if ( got <= 0 ) {
+                if ( got < 0 && errno == EINTR ) {
+                    continue;
+                }
+                errno = got ? errno : EINVAL; // The chunk file is short.
+                goto out;
+            }
+            if ( _writev_all( fd, &( struct iovec ) { buf, ( size_t ) got }, 1 ) ) {
+                goto out;
+            }
+            size -= ( uint64_t ) got;
+            from += ( uint64_t ) got;
+            at += ( uint64_t ) got;
+        }
+    }
+    err = 0;
+out:
+    {
+        int saved_errno = errno;
+        if ( in >= 0 ) {
+            close( in );
+        }
+        free( buf );
+        free( mh );
+        errno = saved_errno;
+    }
+    return err;
+}
 
-    memset( p, 0, (size_t) mem_pd );
-    /* memset( p, 0, (size_t) (mem_pd + padding) ); */
+/** @} */
 
-    return p; 
-}
+/**
+ * @defgroup StatsFuncs Statistics functions.
+ * @brief Runtime statistics, cheap enough to be left on in production.
+ * @details
+ * The counters live in the descriptor of each arena and are updated without atomics, so
+ * ask for the statistics of an arena from the thread that uses it.
+ * @{
+ */
 
+/**
+ * @brief Adds the statistics of one descriptor to out, for one arena out is zeroed first.
+ */
+static void _stats_add( const ArenaDesc *a, struct arena_stats *out )
+{
+    size_t used = (size_t) ( a->bytes_allocated + a->bytes_padding - a->lifetime_mark );
+    size_t peak_padding = a->peak_padding,
+        peak_tail = a->peak_tail;
+    if ( used > a->lifetime_peak ) { // The lifetime in progress is the peak.
+        peak_padding = (size_t) ( a->bytes_padding - a->padding_mark );
+        peak_tail = (size_t) ( a->bytes_tail - a->tail_mark );
+    }
+    out->bytes_oversized += a->bytes_oversized;
+    out->oversized_chunks += a->oversized_chunks;
+    out->bytes_malloced += a->mem_malloced;
+    out->bytes_mmapped += a->mem_mmapped;
+    out->bytes_reserved += a->mem_malloced + a->mem_mmapped;
+    out->bytes_allocated += a->bytes_allocated;
+    out->bytes_padding += a->bytes_padding;
+    out->bytes_tail += a->bytes_tail;
+    out->chunks += a->chunks;
+    out->max_chunk_size = MAX( out->max_chunk_size, a->max_chunk_size );
+    out->lifetime_peak += MAX( a->lifetime_peak, used );
+    out->peak_padding += peak_padding;
+    out->peak_tail += peak_tail;
+    out->requests += a->requests;
+    out->refills += a->refills;
+    out->mallocs += a->mallocs;
+    out->bytes_granted += a->bytes_granted;
+    out->lifetimes += a->lifetimes;
+    if ( a->requests ) {
+        if ( !out->min_request || a->min_request < out->min_request ) {
+            out->min_request = a->min_request;
+        }
+        out->max_request = MAX( out->max_request, a->max_request );
+    }
+    out->avg_request = out->requests ? (size_t) ( out->bytes_allocated / out->requests ) : 0;
+}
 
 /**
- * @brief Allocates memory for an array,zeroes it out.
- * @param n The arena that is the "owner" of the allocation.
- * @param nelem The number of elements in the array.
- * @param mem_sz The size of the individual memoryry..
+ * @brief Gets the statistics of an arena.
+ * @param n The index of the arena.
+ * @param out Where to store the statistics.
  * @details
- * Great for when you need fully initialized memory.
+ * The statistics count from arena_create(), and are kept after arena_destroy(). The
+ * lifetime_peak includes the lifetime in progress.
  */
-void *arena_calloc( size_t n, size_t nelem, size_t mem_sz )
+void arena_stats( size_t n, struct arena_stats *out )
 {
     assert( arenas_initialized == true ) ;
 
@@ -736,45 +3172,64 @@ void *arena_calloc( size_t n, size_t nelem, size_t mem_sz )
         fprintf( stderr, msgBadArena, n, ARENAS_MAX );
         abort(  ); // Overflow conditions.
     }
+    memset( out, 0, sizeof *out );
+    _stats_add( &descs[n], out );
+}
 
-    static const char *emsg = "arena_calloc: Couldn't allocate memory for array with mem_ll: %ld.\n"
-        "The request is larger than ARENAS_MAX_ALLOC: %lu. ";
-    static const char *emsg2 = "arena_calloc: Couldn't allocate memory for array with %ld nelem of size_t %ld.\n"
-        "The request is larger than ARENAS_MAX_ALLOC: %lu. ";
-    assert( mem_sz > 0 ) ;
-    long long mem_ll ;
-    if (nelem > -1ULL/mem_sz) {
-        fprintf( stderr, emsg2, (size_t) nelem, ( size_t ) mem_sz, ARENAS_MAX_ALLOC );
-        abort(  ); // Overflow conditions.
-    } else {
-        mem_ll = nelem * mem_sz;
+/**
+ * @brief Gets the statistics summed over all the arenas.
+ * @param out Where to store the statistics.
+ * @details
+ * The lifetime_peak is the sum of the peaks of the arenas, which is what they would need
+ * if they all peaked at the same time.
+ */
+void arena_stats_global( struct arena_stats *out )
+{
+    assert( arenas_initialized == true ) ;
+
+    memset( out, 0, sizeof *out );
+    for ( uint_32 i = 0; i < ARENAS_MAX; ++i ) {
+        _stats_add( &descs[i], out );
     }
+}
 
-    if ( mem_ll <= 0 ) { // nelem was 0
-        return NULL;
-    } else if ( mem_ll > PTRDIFF_MAX ) {
-        fprintf( stderr, emsg, ( size_t ) mem_ll, ARENAS_MAX_ALLOC);
-        abort(  ); // Overflow conditions.
-    } else if (mem_ll > (ssize_t)ARENAS_MAX_ALLOC) {
-        fprintf( stderr, emsg, ( size_t ) mem_ll, ARENAS_MAX_ALLOC );
+/**
+ * @brief Turns collecting of the histograms of an arena on or off.
+ * @param n The index of the arena.
+ * @param on true to collect, false to stop and forget what is collected.
+ * @details
+ * Call it after arena_create(), which starts out without histograms. Costs a branch on
+ * the fast path when off, and a bucket increment per request when on.
+ */
+void arena_histograms( size_t n, bool on )
+{
+    assert( arenas_initialized == true ) ;
+
+    if ( n >= ARENAS_MAX ) {
+        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
         abort(  ); // Overflow conditions.
-    } else {
-        void *ptr = arena_alloc( n, (size_t) mem_ll ); // Any logging of memory
-                                               // allocatations happens here!
-        return ptr;
-        /* return memset( ptr, 0, (size_t) mem_ll ); */
+    }
+    static const char *emsg = "arena_histograms: couldn't allocate memory for the histograms of arena %lu.";
+    ArenaDesc *a = &descs[n];
+    if ( on && !a->hist ) {
+        a->hist = calloc( 1, sizeof *a->hist );
+        if ( !a->hist ) {
+            _errmsg_write( emsg, n );
+            abort(  );
+        }
+    } else if ( !on ) {
+        free( a->hist );
+        a->hist = NULL;
     }
 }
 
-
 /**
- * @brief Deallocate all objects from a lifetime, when their time is up, but retain the
- * memory for the allocatation of a new set of objects in another lifetime.
- * @param n The index of the arena to deallocate.
- * @details
- * The memory aren't freed from the arena, so it is available for quick reuse.
+ * @brief Copies the histograms of an arena.
+ * @param n The index of the arena.
+ * @param out Where to store the histograms.
+ * @return false if the arena doesn't collect histograms.
  */
-void arena_dealloc( size_t n )
+bool arena_histogram( size_t n, struct arena_histogram *out )
 {
     assert( arenas_initialized == true ) ;
 
@@ -782,97 +3237,555 @@ void arena_dealloc( size_t n )
         fprintf( stderr, msgBadArena, n, ARENAS_MAX );
         abort(  ); // Overflow conditions.
     }
-    arenas[n] = first[n].next;
-    if ( arenas[n] ) {
-        arenas[n]->begin = ( char * ) arenas[n] + sizeof *arenas[n];
-       // Works out beautifully with _alloc(),  which resets.
-    } else {
-        arenas[n] = &first[n];
+    if ( !descs[n].hist ) {
+        return false;
+    }
+    *out = *descs[n].hist;
+    return true;
+}
+
+/**
+ * @brief Finds the lifetime peak at a quantile in the sketch.
+ * @param h The histograms.
+ * @param q The quantile, from 0.0 to 1.0.
+ * @return The lower bound of the bucket the quantile falls in, 0 if nothing is counted.
+ */
+size_t arena_hist_peak_quantile( const struct arena_histogram *h, double q )
+{
+    unsigned long long total = 0,
+        seen = 0;
+    for ( unsigned i = 0; i < ARENA_HIST_PEAKS; ++i ) {
+        total += h->peaks[i];
+    }
+    if ( !total ) {
+        return 0;
+    }
+    unsigned long long rank = ( unsigned long long ) ( q * ( double ) total );
+    if ( rank >= total ) {
+        rank = total - 1;
+    }
+    for ( unsigned i = 0; i < ARENA_HIST_PEAKS; ++i ) {
+        seen += h->peaks[i];
+        if ( seen > rank ) {
+            return _hist_peak_floor( i );
+        }
     }
+    return 0;
 }
 
 /** @} */
 
 /**
- * @defgroup InitDeinit Initialization and destroy functions. 
+ * @defgroup DumpFuncs Statistics dumps.
+ * @brief Dumps of the statistics of live processes, as JSON or in the Prometheus text
+ * exposition format.
+ * @details
+ * The formatting only uses string and integer conversions of our own into a buffer, so
+ * that the same code can run in a signal handler, into a buffer allocated up front.
  * @{
  */
+
+/** A buffer to format a dump into, what doesn't fit is dropped and flagged. */
+struct dumpbuf {
+    char *buf;   /**< The buffer. */
+    size_t len;  /**< The bytes used. */
+    size_t cap;  /**< The size of the buffer. */
+    bool full;   /**< Set when something didn't fit. */
+};
+
+/** Appends a string to a dump. */
+static void _db_str( struct dumpbuf *db, const char *str )
+{
+    size_t len = strlen( str );
+    if ( len > db->cap - db->len ) {
+        db->full = true;
+        return;
+    }
+    memcpy( db->buf + db->len, str, len );
+    db->len += len;
+}
+
+/** Appends a number in decimal to a dump. */
+static void _db_num( struct dumpbuf *db, unsigned long long v )
+{
+    char digits[24];
+    int i = sizeof digits - 1;
+    digits[i] = '\0';
+    do {
+        digits[--i] = ( char ) ( '0' + v % 10 );
+        v /= 10;
+    } while ( v );
+    _db_str( db, digits + i );
+}
+
+/** A field of struct arena_stats in a dump. */
+struct dump_field {
+    const char *name;  /**< The name of the field and metric. */
+    const char *help;  /**< The help text of the metric. */
+    size_t offset;     /**< The offset of the field in struct arena_stats. */
+    bool counter;      /**< The field is an unsigned long long counter, else a size_t gauge. */
+};
+
+/** The fields of struct arena_stats that are dumped. */
+static const struct dump_field dump_fields[] = {
+    { "bytes_reserved", "Bytes malloc has reserved for the chunks.", offsetof( struct arena_stats, bytes_reserved ), false },
+    { "bytes_malloced", "Bytes of the chunks malloc serves from the heap.", offsetof( struct arena_stats, bytes_malloced ), false },
+    { "bytes_mmapped", "Bytes of the chunks malloc serves with mmap.", offsetof( struct arena_stats, bytes_mmapped ), false },
+    { "chunks", "The number of chunks.", offsetof( struct arena_stats, chunks ), false },
+    { "max_chunk_size", "The largest chunk.", offsetof( struct arena_stats, max_chunk_size ), false },
+    { "lifetime_peak", "The most bytes handed out in a lifetime.", offsetof( struct arena_stats, lifetime_peak ), false },
+    { "min_request", "The smallest request.", offsetof( struct arena_stats, min_request ), false },
+    { "max_request", "The largest request.", offsetof( struct arena_stats, max_request ), false },
+    { "avg_request", "The average request.", offsetof( struct arena_stats, avg_request ), false },
+    { "peak_padding", "Bytes lost to padding in the lifetime of the peak.", offsetof( struct arena_stats, peak_padding ), false },
+    { "peak_tail", "Bytes lost to chunk tails in the lifetime of the peak.", offsetof( struct arena_stats, peak_tail ), false },
+    { "bytes_oversized", "Bytes in retained one-off oversized chunks.", offsetof( struct arena_stats, bytes_oversized ), false },
+    { "oversized_chunks", "Retained one-off oversized chunks.", offsetof( struct arena_stats, oversized_chunks ), false },
+    { "bytes_allocated", "Bytes requested and handed out.", offsetof( struct arena_stats, bytes_allocated ), true },
+    { "bytes_padding", "Bytes lost to padding.", offsetof( struct arena_stats, bytes_padding ), true },
+    { "bytes_tail", "Bytes lost to chunk tails.", offsetof( struct arena_stats, bytes_tail ), true },
+    { "requests", "Requests served.", offsetof( struct arena_stats, requests ), true },
+    { "refills", "Requests served from another chunk.", offsetof( struct arena_stats, refills ), true },
+    { "lifetimes", "Lifetimes ended by arena_dealloc.", offsetof( struct arena_stats, lifetimes ), true },
+    { "mallocs", "Chunks malloc'ed.", offsetof( struct arena_stats, mallocs ), true },
+    { "bytes_granted", "Bytes of all the chunks malloc'ed.", offsetof( struct arena_stats, bytes_granted ), true },
+};
+
+/** The number of fields in dump_fields. */
+#define DUMP_FIELDS ( sizeof dump_fields / sizeof dump_fields[0] )
+
+/** The value of a field of a struct arena_stats. */
+static unsigned long long _dump_value( const struct arena_stats *st, const struct dump_field *f )
+{
+    const char *p = ( const char * ) st + f->offset;
+    return f->counter ? *( const unsigned long long * ) p : *( const size_t * ) p;
+}
+
+/** Appends the fields of st as the members of a JSON object. */
+static void _dump_json_object( struct dumpbuf *db, const struct arena_stats *st )
+{
+    for ( size_t f = 0; f < DUMP_FIELDS; ++f ) {
+        _db_str( db, f ? ",\"" : "\"" );
+        _db_str( db, dump_fields[f].name );
+        _db_str( db, "\":" );
+        _db_num( db, _dump_value( st, &dump_fields[f] ) );
+    }
+}
+
+/** Formats the statistics of all the arenas, and the global ones, into db. */
+static void _dump_format( struct dumpbuf *db, int format )
+{
+    struct arena_stats st;
+
+    if ( format == ARENA_DUMP_JSON ) {
+        _db_str( db, "{\"arenas\":[" );
+        for ( uint_32 i = 0; i < ARENAS_MAX; ++i ) {
+            arena_stats( i, &st );
+            _db_str( db, i ? ",{\"arena\":" : "{\"arena\":" );
+            _db_num( db, i );
+            _db_str( db, "," );
+            _dump_json_object( db, &st );
+            _db_str( db, "}" );
+        }
+        arena_stats_global( &st );
+        _db_str( db, "],\"global\":{" );
+        _dump_json_object( db, &st );
+        _db_str( db, "}}\n" );
+        return;
+    }
+   // Prometheus, one metric family at a time, with a sample for every arena.
+    for ( size_t f = 0; f < DUMP_FIELDS; ++f ) {
+        const struct dump_field *df = &dump_fields[f];
+        const char *suffix = df->counter ? "_total" : "";
+        _db_str( db, "# HELP core_arena_" );
+        _db_str( db, df->name );
+        _db_str( db, suffix );
+        _db_str( db, " " );
+        _db_str( db, df->help );
+        _db_str( db, "\n# TYPE core_arena_" );
+        _db_str( db, df->name );
+        _db_str( db, suffix );
+        _db_str( db, df->counter ? " counter\n" : " gauge\n" );
+        for ( uint_32 i = 0; i < ARENAS_MAX; ++i ) {
+            arena_stats( i, &st );
+            _db_str( db, "core_arena_" );
+            _db_str( db, df->name );
+            _db_str( db, suffix );
+            _db_str( db, "{arena=\"" );
+            _db_num( db, i );
+            _db_str( db, "\"} " );
+            _db_num( db, _dump_value( &st, df ) );
+            _db_str( db, "\n" );
+        }
+    }
+}
+
+/** A size of the buffer that holds a dump of all the arenas in either format. */
+static size_t _dump_size( void )
+{
+    return 4096 + ( size_t ) ( ARENAS_MAX + 1 ) * DUMP_FIELDS * 64;
+}
+
+/**
+ * @brief Writes the statistics of all the arenas, and the global ones.
+ * @param fp The stream to write to.
+ * @param format ARENA_DUMP_JSON or ARENA_DUMP_PROMETHEUS.
+ * @return 0, or -1 with errno set if the dump couldn't be written.
+ */
+int arena_stats_dump( FILE *fp, int format )
+{
+    assert( arenas_initialized == true ) ;
+
+    struct dumpbuf db = { NULL, 0, _dump_size(  ), false };
+    db.buf = malloc( db.cap );
+    if ( !db.buf ) {
+        return -1;
+    }
+    _dump_format( &db, format );
+    int ret = fwrite( db.buf, 1, db.len, fp ) == db.len && !db.full ? 0 : -1;
+    free( db.buf );
+    return ret;
+}
+
+/** The set up of the signal handler that dumps the statistics. */
+static struct {
+    char *buf;      /**< The buffer, allocated up front. */
+    size_t cap;     /**< The size of the buffer. */
+    char *path;     /**< The file to write, or NULL to write to fd. */
+    char *tmp_path; /**< path with ".tmp" added, written and renamed to path. */
+    int fd;         /**< The file descriptor to write to when there is no path. */
+    int format;     /**< ARENA_DUMP_JSON or ARENA_DUMP_PROMETHEUS. */
+} dump_sig;
+
 /**
- * @brief Creates a ready to use arena, and configures the arena to support a chunk_sz.
- * @param n The index of the arena to destroy.
- * @param chunk_sz The nominal size of the arena to allocate memory from.
+ * @brief The signal handler that dumps the statistics.
  * @details
- * Aborts if something is wrong.
+ * Only uses async-signal-safe calls, and only reads the counters in the descriptors,
+ * never the chunks, which the threads of the arenas may be freeing. A file is written
+ * beside the configured one and renamed over it, so a scraper never sees half a dump.
  */
-void arena_create( size_t n, size_t chunk_sz )
+static void _dump_signal_handler( int signo )
+{
+    int saved_errno = errno;
+    (void) signo;
+
+    struct dumpbuf db = { dump_sig.buf, 0, dump_sig.cap, false };
+    _dump_format( &db, dump_sig.format );
+    if ( dump_sig.path ) {
+        int fd = open( dump_sig.tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+        if ( fd >= 0 ) {
+            _write_all( fd, db.buf, db.len );
+            close( fd );
+            rename( dump_sig.tmp_path, dump_sig.path );
+        }
+    } else {
+        _write_all( dump_sig.fd, db.buf, db.len );
+    }
+    errno = saved_errno;
+}
+
+/**
+ * @brief Installs a handler that dumps the statistics when a signal arrives.
+ * @param signo The signal, typically SIGUSR1.
+ * @param path The file to write the dump to, or NULL to write to fd.
+ * @param fd The file descriptor to write to when path is NULL.
+ * @param format ARENA_DUMP_JSON or ARENA_DUMP_PROMETHEUS.
+ * @return 0, or -1 with errno set.
+ * @details
+ * The buffer the dump is formatted into is allocated here, for the number of arenas given
+ * to arena_init_arenas(). The handler reads the counters of arenas that may be in use, so a
+ * dump is a snapshot and not a consistent cut.
+ */
+int arena_stats_on_signal( int signo, const char *path, int fd, int format )
 {
     assert( arenas_initialized == true ) ;
-#if ARENAS_LOG_LEVEL > 0
-    static bool log_inited;
-    if ( !log_inited ) {
-        atexit( report_memory_usage );
-        log_inited = true;
+
+    size_t cap = _dump_size(  );
+    char *buf = malloc( cap ),
+        *p = NULL,
+        *tmp = NULL;
+    if ( path ) {
+        p = malloc( strlen( path ) + 1 );
+        tmp = malloc( strlen( path ) + sizeof ".tmp" );
     }
-#endif
-    if ( n >= ARENAS_MAX ) {
-        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
-        abort(  ); // Overflow conditions.
+    if ( !buf || ( path && ( !p || !tmp ) ) ) {
+        free( buf );
+        free( p );
+        free( tmp );
+        errno = ENOMEM;
+        return -1;
+    }
+    if ( path ) {
+        strcpy( p, path );
+        strcpy( tmp, path );
+        strcat( tmp, ".tmp" );
     }
 
-    static const char *emsg = "arena_create: Couldn't allocate memory for arena with chunk_sz: %lu.";
-    /// @todo reuse error message as well.
-   // First reject anything nonsensical or excessively large .
-    if ( chunk_sz == 0 || chunk_sz > PTRDIFF_MAX ) {
-        fprintf( stderr, emsg, chunk_sz );
-        abort(  );
+    struct sigaction sa,
+        old;
+    memset( &sa, 0, sizeof sa );
+    sigemptyset( &sa.sa_mask );
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = SIG_IGN; // Until the new set up is in place.
+    if ( sigaction( signo, &sa, &old ) ) {
+        free( buf );
+        free( p );
+        free( tmp );
+        return -1;
     }
+   // A handler installed before has been replaced, so its set up can go.
+    free( dump_sig.buf );
+    free( dump_sig.path );
+    free( dump_sig.tmp_path );
+    dump_sig.buf = buf;
+    dump_sig.cap = cap;
+    dump_sig.path = p;
+    dump_sig.tmp_path = tmp;
+    dump_sig.fd = fd;
+    dump_sig.format = format;
+    sa.sa_handler = _dump_signal_handler;
+    return sigaction( signo, &sa, NULL );
+}
 
-    first[n].next = _arena_init( n, chunk_sz );
-    first[n].chunk_sz = first[n].next->chunk_sz ;
-    // default chunk_sz for each block for arena[n] adjusted for padding ;
-    /// @todo: first step, next is to subtract AHS.
-    if ( first[n].next == NULL ) {
-        fprintf( stderr, emsg, chunk_sz );
-        abort(  );
+/** @} */
+
+/**
+ * @defgroup TraceFuncs Allocation trace recorder.
+ * @brief Records every arena_create, arena_alloc, arena_calloc, arena_dealloc and
+ * arena_destroy, so the allocations of a production run can be replayed offline.
+ * @details
+ * Every thread records into a ring of its own, which is written to the trace file with
+ * one write when it is full. The file starts with a struct arena_trace_header, followed
+ * by struct arena_trace_event records, in the order of the rings of the threads. See
+ * bench/replay.c.
+ * @{
+ */
+
+/**
+ * @brief Starts recording an allocation trace.
+ * @param path The trace file, truncated if it exists.
+ * @return 0, or -1 with errno set.
+ */
+int arena_trace_start( const char *path )
+{
+    assert( arenas_initialized == true ) ;
+
+    static bool exit_inited;
+    if ( _tracing(  ) ) {
+        arena_trace_stop(  );
+    }
+    int fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644 );
+    if ( fd < 0 ) {
+        return -1;
+    }
+    struct arena_trace_header hdr;
+    memset( &hdr, 0, sizeof hdr );
+    memcpy( hdr.magic, ARENA_TRACE_MAGIC, sizeof hdr.magic );
+    hdr.version = ARENA_TRACE_VERSION;
+    hdr.arenas = ARENAS_MAX;
+    hdr.chunk_hdr = ( uint32_t ) sizeof( Arena );
+    hdr.malloc_hdr = ( uint32_t ) malloc_hdr_sz;
+    hdr.mmap_hdr = ( uint32_t ) mmap_hdr_sz;
+    hdr.page = ( uint32_t ) page_sz;
+    hdr.mmap_threshold = __atomic_load_n( &mmap_threshold, __ATOMIC_RELAXED );
+    if ( write( fd, &hdr, sizeof hdr ) != ( ssize_t ) sizeof hdr ) {
+        close( fd );
+        return -1;
     }
+    clock_gettime( CLOCK_MONOTONIC, &trace_start );
+    trace_fd = fd;
+    __atomic_add_fetch( &trace_gen, 1, __ATOMIC_SEQ_CST );
+    __atomic_store_n( &trace_on, true, __ATOMIC_RELEASE );
+    if ( !exit_inited ) {
+        atexit( arena_trace_stop );
+        exit_inited = true;
+    }
+    return 0;
+}
 
-#if ARENAS_LOG_LEVEL > 0
-#ifndef CORE_ARENA_NO_LOGGING
-    allocated_chunks[n] += chunk_sz;
-    allocation_chunk_count[n] += 1 ;
-#endif
-#endif
-    arenas[n] = first[n].next;
+/**
+ * @brief Writes the events recorded by this thread to the trace file.
+ * @details
+ * A thread that exits writes its events itself. Threads that are still running when
+ * another one stops the trace must call it before, or the end of their events is lost.
+ */
+void arena_trace_flush( void )
+{
+    _trace_flush_ring(  );
 }
 
 /**
- * @brief Destroys an arena frees all memory.
- * @param n The index of the arena to destroy.
+ * @brief Stops recording, writes the events of this thread, and closes the trace file.
  * @details
- * All memory is released into the common pool of free memory.
- *
+ * The events other threads have not flushed yet are dropped, they are never written to
+ * the next trace. The file is closed once the rings being written have been written.
+ */
+void arena_trace_stop( void )
+{
+    if ( !_tracing(  ) ) {
+        return;
+    }
+    _trace_flush_ring(  );
+    if ( !__atomic_exchange_n( &trace_on, false, __ATOMIC_SEQ_CST ) ) {
+        return; // Stopped by another thread.
+    }
+    while ( __atomic_load_n( &trace_writers, __ATOMIC_SEQ_CST ) ) {
+        sched_yield(  );
+    }
+    close( trace_fd );
+    trace_fd = -1;
+}
+
+/** @} */
+
+/**
+ * @defgroup PressureFuncs Trimming under memory pressure.
+ * @brief Gives the retained chunks back when the system, or the cgroup, runs short.
+ * @details
+ * A thread waits on a PSI trigger. The arenas are owned by the threads that allocate from
+ * them, an arena is parked by arena_dealloc(), and claimed back by its owner before
+ * anything but the fast path, see _desc_claim(). The thread trims the parked arenas
+ * itself, so the idle ones give their chunks back too. For the others it bumps trim_epoch,
+ * and they free their retained chunks at their next arena_dealloc(), when nothing of the
+ * lifetime is in them. Then it calls malloc_trim().
+ * @{
  */
 
-void arena_destroy( size_t n )
+/** The thread waiting for memory pressure. */
+static struct {
+    pthread_t thread;
+    int fd;       /**< The PSI trigger. */
+    int wake[2];  /**< A pipe that wakes the thread to stop. */
+    bool on;
+} pressure = { .fd = -1, .wake = { -1, -1 } };
+
+/**
+ * @brief Trims the parked arenas, and has the others trim themselves at their next
+ * arena_dealloc().
+ */
+static void _pressure_trim( void )
+{
+    unsigned epoch = __atomic_add_fetch( &trim_epoch, 1, __ATOMIC_RELAXED );
+    for ( uint_32 i = 0; i < ARENAS_MAX; ++i ) {
+        ArenaDesc *a = &descs[i];
+        unsigned char st = DESC_PARKED;
+        if ( __atomic_compare_exchange_n( &a->state, &st, DESC_TRIMMING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) {
+            _trim( a ); // The fast path only uses the head, made current by arena_dealloc().
+            a->trim_mark = epoch;
+            __atomic_store_n( &a->state, DESC_PARKED, __ATOMIC_RELEASE );
+        }
+    }
+#ifdef __GLIBC__
+    malloc_trim( 0 );
+#endif
+}
+
+static void *_pressure_thread( void *arg )
+{
+    ( void ) arg;
+    struct pollfd fds[2] = { { pressure.fd, POLLPRI, 0 }, { pressure.wake[0], POLLIN, 0 } };
+    for ( ;; ) {
+        if ( poll( fds, 2, -1 ) < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            break;
+        }
+       // Stopped, or the trigger is gone with its cgroup.
+        if ( fds[1].revents || ( fds[0].revents & ( POLLERR | POLLNVAL ) ) ) {
+            break;
+        }
+        if ( fds[0].revents & POLLPRI ) {
+            _pressure_trim(  );
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts trimming the arenas under memory pressure.
+ * @param path The PSI file, NULL for the memory.pressure of our cgroup v2, or
+ * /proc/pressure/memory.
+ * @param stall_us The microseconds some tasks must stall on memory within the window.
+ * @param window_us The window, the kernel wants 500ms - 10s, and whole 2s for unprivileged
+ * processes.
+ * @return 0, or -1 with errno set.
+ */
+int arena_pressure_start( const char *path, unsigned stall_us, unsigned window_us )
 {
     assert( arenas_initialized == true ) ;
 
-    if ( n >= ARENAS_MAX ) {
-        fprintf( stderr, msgBadArena, n, ARENAS_MAX );
-        abort(  ); // Overflow conditions.
+    static bool exit_inited;
+    char file[2 * CGROUP_PATH_SIZE], cpath[CGROUP_PATH_SIZE - sizeof CGROUP_V1_ROOT], trigger[64];
+    if ( pressure.on ) {
+        arena_pressure_stop(  );
+    }
+    if ( !path ) {
+        bool v2 = false;
+        const char *root = _cgroup_path( cpath, sizeof cpath, &v2 );
+        path = "/proc/pressure/memory";
+        if ( root && v2 ) {
+            snprintf( file, sizeof file, "%s%s/memory.pressure", root, cpath );
+            if ( !access( file, F_OK ) ) {
+                path = file;
+            }
+        }
+    }
+    int fd = open( path, O_RDWR | O_NONBLOCK | O_CLOEXEC );
+    if ( fd < 0 ) {
+        return -1;
+    }
+    int len = snprintf( trigger, sizeof trigger, "some %u %u", stall_us, window_us );
+    if ( write( fd, trigger, ( size_t ) len + 1 ) < 0 || pipe( pressure.wake ) ) {
+        int saved_errno = errno;
+        close( fd );
+        errno = saved_errno;
+        return -1;
     }
+    fcntl( pressure.wake[0], F_SETFD, FD_CLOEXEC );
+    fcntl( pressure.wake[1], F_SETFD, FD_CLOEXEC );
+    pressure.fd = fd;
+   // The signals of the process are for its own threads.
+    sigset_t all, old;
+    sigfillset( &all );
+    pthread_sigmask( SIG_SETMASK, &all, &old );
+    int err = pthread_create( &pressure.thread, NULL, _pressure_thread, NULL );
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+    if ( err ) {
+        close( pressure.fd );
+        close( pressure.wake[0] );
+        close( pressure.wake[1] );
+        pressure.fd = pressure.wake[0] = pressure.wake[1] = -1;
+        errno = err;
+        return -1;
+    }
+    pressure.on = true;
+    if ( !exit_inited ) {
+        atexit( arena_pressure_stop );
+        exit_inited = true;
+    }
+    return 0;
+}
 
-    Arena *p,
-    *q;
-    for ( p = ( Arena * ) ( first[n].next ); p; ) {
-        q = p->next;
-        free( p );
-        p = q;
+/**
+ * @brief Stops trimming the arenas under memory pressure.
+ */
+void arena_pressure_stop( void )
+{
+    if ( !pressure.on ) {
+        return;
+    }
+    pressure.on = false;
+    char c = 0;
+    if ( write( pressure.wake[1], &c, 1 ) == 1 ) {
+        pthread_join( pressure.thread, NULL );
+    } else {
+        pthread_detach( pressure.thread );
     }
-    tot_mem_usage -= arenas_mem_malloced[n] ;
-    tot_mem_usage -= arenas_mem_mmapped[n] ;
-    first[n].next = NULL;
-    arenas[n] = NULL;
+    close( pressure.fd );
+    close( pressure.wake[0] );
+    close( pressure.wake[1] );
+    pressure.fd = pressure.wake[0] = pressure.wake[1] = -1;
 }
 
 /** @} */
@@ -33,6 +33,10 @@
 #include <stdarg.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
 
 typedef unsigned int uint_32;
 
@@ -40,16 +44,211 @@ typedef unsigned int uint_32;
  * see: https://www.codesynthesis.com/~boris/blog/2009/04/06/cxx-data-alignment-portability */
 #define MAX_ALIGN 16
 /** the size of the pointer malloc needs into the memory block, probably same as WORD_SIZE
- * and thereby MAX_ALIGN, but you never know. */
+ * and thereby MAX_ALIGN, but you never know. With glibc the size is found with
+ * malloc_usable_size() when the arenas are initialized, and this is only a fallback. */
 #define MALLOC_PTR_SIZE 8
+/** The size of a cache line, the per arena descriptors are padded to this size so that
+ * arenas used by different threads don't share cache lines. */
+#define CACHE_LINE_SIZE 64
+
+/** Marks the functions of the API, the only symbols libcore_arena.so exports, as the
+ * library is built with -fvisibility=hidden. */
+#ifndef CORE_ARENA_API
+#if defined(__GNUC__)
+#define CORE_ARENA_API __attribute__((visibility("default")))
+#else
+#define CORE_ARENA_API
+#endif
+#endif
 
 /** There is a test program "memmax.c" in the misc folder you can run to find your systems
  * cap for memory allocations.  */
 /* #define ARENAS_MAX_ALLOC 15200157696LL */
 
-void arena_init_arenas(size_t count) ;
+/** Constant for no logging */
+#define NO_ARENA_LOGGING 0
+/** Constant for logging allocations of memory for the arenas. */
+#define LOG_CHUNK_MALLOCS 1
+/** Constant for logging both allocations of memory *for* the arenas, and the allocations
+ * of memory *from* the arenas. */
+#define FULL_ARENA_LOGGING 2
+
+/** Format of arena_stats_dump(), JSON. */
+#define ARENA_DUMP_JSON 0
+/** Format of arena_stats_dump(), the Prometheus text exposition format. */
+#define ARENA_DUMP_PROMETHEUS 1
+
+/** The magic at the start of a trace file. */
+#define ARENA_TRACE_MAGIC "CATRACE1"
+/** The version of the trace file format. */
+#define ARENA_TRACE_VERSION 2
+/** Trace event of arena_create, size is the chunk_sz, aux the log2 of the alignment or 0. */
+#define ARENA_TRACE_CREATE 1
+/** Trace event of arena_alloc, size is the request. */
+#define ARENA_TRACE_ALLOC 2
+/** Trace event of arena_calloc, size is nelem * mem_sz. */
+#define ARENA_TRACE_CALLOC 3
+/** Trace event of arena_dealloc. */
+#define ARENA_TRACE_DEALLOC 4
+/** Trace event of arena_destroy. */
+#define ARENA_TRACE_DESTROY 5
+
+/** The header of a trace file, with what the library found out about malloc, so a trace
+ * can be modelled as it would have been served. */
+struct arena_trace_header {
+    char magic[8];           /**< ARENA_TRACE_MAGIC, not terminated. */
+    uint32_t version;        /**< ARENA_TRACE_VERSION. */
+    uint32_t arenas;         /**< The number of arenas when the trace was started. */
+    uint32_t chunk_hdr;      /**< The bytes of the header of a chunk, before MAX_ALIGN rounding. */
+    uint32_t malloc_hdr;     /**< The bytes malloc keeps in front of a block. */
+    uint32_t mmap_hdr;       /**< The bytes malloc keeps of the pages of a mapping, 0 if unknown. */
+    uint32_t page;           /**< The page size. */
+    uint64_t mmap_threshold; /**< malloc's mmap threshold when the trace was started. */
+};
+
+/** An event in a trace file. */
+struct arena_trace_event {
+    uint64_t ts;    /**< Nanoseconds since the trace was started. */
+    uint64_t size;  /**< The size of the request, or the chunk_sz. */
+    uint32_t arena; /**< The arena. */
+    uint16_t type;  /**< One of the ARENA_TRACE_* event types. */
+    uint16_t aux;   /**< The log2 of the alignment for ARENA_TRACE_CREATE. */
+};
+
+/** The magic at the start of the file of a mapped arena. */
+#define ARENA_FILE_MAGIC "CAMAPPED"
+/** The version of the file format of the mapped arenas. */
+#define ARENA_FILE_VERSION 1
+/** Leave writing the file of a mapped arena back to the kernel. */
+#define ARENA_SYNC_NONE 0
+/** Start writing the file of a mapped arena back, with msync(MS_ASYNC). */
+#define ARENA_SYNC_ASYNC 1
+/** Write the file of a mapped arena back, and wait for it, with msync(MS_SYNC). */
+#define ARENA_SYNC_WAIT 2
+
+/** A chunk in the table of the file of a mapped arena. */
+struct arena_file_chunk {
+    uint64_t offset; /**< Where the chunk starts in the file. */
+    uint64_t size;   /**< The bytes of the chunk. */
+};
+
+/** The header of the file of a mapped arena, followed by its chunk table, on whole pages. */
+struct arena_file_header {
+    char magic[8];       /**< ARENA_FILE_MAGIC, not terminated. */
+    uint32_t version;    /**< ARENA_FILE_VERSION. */
+    uint32_t page_sz;    /**< The page size, the header and the chunks are whole pages. */
+    uint64_t reserve;    /**< The bytes of address space mapped, the largest the file may be. */
+    uint64_t hdr_sz;     /**< The bytes of the header and the table, where the chunks start. */
+    uint64_t base;       /**< The address the file was mapped at, asked for the next time. */
+    uint64_t root;       /**< The offset of the root object, 0 for none. */
+    uint64_t cur;        /**< The offset of the chunk the arena allocates from. */
+    uint64_t begin;      /**< The offset of the next free byte in it. */
+    uint64_t max_chunks; /**< The room in the table. */
+    uint64_t chunks;     /**< The chunks in the table, in the order of the chain and the file. */
+    struct arena_file_chunk chunk[]; /**< The table. */
+};
+
+/** The magic at the start of an image of arena_snapshot(). */
+#define ARENA_IMAGE_MAGIC "CAIMAGE1"
+/** The version of the image format. */
+#define ARENA_IMAGE_VERSION 1
+
+/** The header of an image of arena_snapshot(), followed by its chunk table, on whole pages,
+ * and the chunks, at the offsets of the table. */
+struct arena_image_header {
+    char magic[8];    /**< ARENA_IMAGE_MAGIC, not terminated. */
+    uint32_t version; /**< ARENA_IMAGE_VERSION. */
+    uint32_t align;   /**< The alignment of the chunks in the image. */
+    uint64_t size;    /**< The bytes of the image. */
+    uint64_t root;    /**< The offset of the root object, 0 for none. */
+    uint64_t chunks;  /**< The chunks in the table, in the order of the chain. */
+    struct arena_file_chunk chunk[]; /**< The table. */
+};
+
+/** The magic at the start of the manifest of the checkpoints of arena_checkpoint(). */
+#define ARENA_MANIFEST_MAGIC "CAMANIF1"
+/** The version of the manifest format. */
+#define ARENA_MANIFEST_VERSION 1
+
+/** The header of a manifest, followed by the header and table of the image it restores,
+ * img_sz bytes, and a struct arena_manifest_chunk for every chunk in the table. */
+struct arena_manifest_header {
+    char magic[8];    /**< ARENA_MANIFEST_MAGIC, not terminated. */
+    uint32_t version; /**< ARENA_MANIFEST_VERSION. */
+    uint32_t unused;
+    uint64_t seq;     /**< The number of the checkpoint. */
+    uint64_t img_sz;  /**< The bytes of the image header and its table that follow. */
+};
+
+/** Where a chunk of the image of a manifest is. */
+struct arena_manifest_chunk {
+    uint64_t gen;    /**< The checkpoint whose file, chunks.<gen>, has it. */
+    uint64_t offset; /**< Where it is in that file. */
+};
+
+/** An image mapped by arena_load(). */
+struct arena_image {
+    void *base;  /**< The mapping, the header is here. */
+    size_t size; /**< The bytes mapped. */
+    void *root;  /**< The root object, NULL for none. */
+};
 
-void arena_create(size_t n, size_t chunk_sz);
+/** A self-relative pointer, the distance from itself to what it points to, 0 for NULL. It
+ * holds wherever the memory it is in is mapped, as long as the distance does. */
+typedef int64_t arena_rel;
+
+/** Stores the pointer p in the arena_rel rel, both are evaluated twice, so no side effects. */
+#define ARENA_REL_STORE(rel, p) \
+    ((rel) = (p) ? (arena_rel) ((const char *) (p) - (const char *) &(rel)) : 0)
+
+/** Loads the arena_rel rel as a pointer to type, rel is evaluated three times, so no side
+ * effects. */
+#define ARENA_REL_LOAD(type, rel) \
+    ((rel) ? (type *) ((char *) &(rel) + (rel)) : (type *) NULL)
+
+/** Statistics of an arena, or of all the arenas, see arena_stats(). */
+struct arena_stats {
+    size_t bytes_reserved;  /**< Bytes malloc has reserved for the chunks. */
+    size_t bytes_malloced;  /**< The part of bytes_reserved malloc serves from the heap. */
+    size_t bytes_mmapped;   /**< The part of bytes_reserved malloc serves with mmap. */
+    size_t chunks;          /**< The number of chunks. */
+    size_t max_chunk_size;  /**< The largest chunk. */
+    size_t lifetime_peak;   /**< The most bytes handed out, padding included, in a lifetime. */
+    size_t min_request;     /**< The smallest request. */
+    size_t max_request;     /**< The largest request. */
+    size_t avg_request;     /**< The average request. */
+    size_t peak_padding;    /**< Bytes lost to MAX_ALIGN padding in the lifetime of the peak. */
+    size_t peak_tail;       /**< Bytes lost at the end of chunks in the lifetime of the peak. */
+    size_t bytes_oversized; /**< Bytes reserved in retained one-off chunks larger than chunk_sz. */
+    size_t oversized_chunks; /**< The number of retained one-off chunks larger than chunk_sz. */
+    unsigned long long bytes_allocated; /**< Bytes requested and handed out. */
+    unsigned long long bytes_padding;   /**< Bytes lost to MAX_ALIGN padding of the requests. */
+    unsigned long long bytes_tail;      /**< Bytes lost at the end of chunks we moved on from. */
+    unsigned long long requests;        /**< The number of requests served. */
+    unsigned long long refills;         /**< The number of requests served from another chunk. */
+    unsigned long long mallocs;         /**< The number of chunks malloc'ed. */
+    unsigned long long bytes_granted;   /**< The bytes of all the chunks malloc'ed. */
+    unsigned long long lifetimes;       /**< The number of arena_dealloc() calls. */
+};
+
+/** The number of log2 buckets for the request sizes, bucket i counts [2^i, 2^(i+1)). */
+#define ARENA_HIST_SIZES 64
+/** Linear sub buckets per power of two in the lifetime peak sketch, as a power of two. */
+#define ARENA_HIST_SUB_BITS 3
+/** The number of buckets in the lifetime peak sketch. */
+#define ARENA_HIST_PEAKS ((64 - ARENA_HIST_SUB_BITS + 1) << ARENA_HIST_SUB_BITS)
+
+/** Distributions of an arena, see arena_histograms(). */
+struct arena_histogram {
+    unsigned long long sizes[ARENA_HIST_SIZES]; /**< log2 buckets of the request sizes. */
+    /** HDR style buckets of the bytes handed out per lifetime, every power of two is split
+     * into 2^ARENA_HIST_SUB_BITS linear buckets. */
+    unsigned long long peaks[ARENA_HIST_PEAKS];
+};
+
+CORE_ARENA_API void arena_init_arenas(size_t count) ;
+
+CORE_ARENA_API void arena_create(size_t n, size_t chunk_sz);
 /* Creates a ready to use arena, and configures the arena to support a chunk_sz.
  *
  * We consider how malloc operates carefully to optimize block sizes and thereby improves
@@ -63,21 +262,185 @@ void arena_create(size_t n, size_t chunk_sz);
  * * I recommend the smallest chunk_sz requested to be 1024 bytes.
  */
 
+CORE_ARENA_API void arena_create_aligned(size_t n, size_t chunk_sz, size_t align);
+/* Creates a ready to use arena like arena_create, but keeps the book keeping of the chunks
+ * out of band, so that the memory handed out from each chunk starts at an align boundary,
+ * typically CACHE_LINE_SIZE or the page size. An align of 0 is the same as arena_create.
+ */
+
+CORE_ARENA_API void arena_set_adaptive(size_t n, size_t min_chunk_sz, size_t max_chunk_sz);
+/* Makes an arena, after arena_create, adjust the chunk_sz of its new chunks at every
+ * arena_dealloc, within the bounds, so that a lifetime is served from one or a few chunks.
+ * A max_chunk_sz of 0 turns it off. */
+
+/** Called when an arena crosses its soft budget, with the arena, the bytes it would have
+ * reserved, and the ctx given to arena_set_budget. */
+typedef void (*arena_budget_fn)(size_t n, size_t reserved, void *ctx);
+
+CORE_ARENA_API void arena_set_budget(size_t n, size_t soft, size_t hard, arena_budget_fn fn, void *ctx);
+/* Sets budgets, before or after arena_create, which keeps them, for the bytes malloc
+ * reserves for the chunks of an arena. When a new chunk would take it over the soft budget,
+ * fn is called once, until it is under it again, and may shed load, trim the arenas the
+ * thread owns, or grant more budget. Requests that would take it over the hard budget, or
+ * ARENAS_MAX_ALLOC, return NULL with errno ENOMEM instead of aborting, and arena_create
+ * leaves the first chunk to the first request then. 0 is no budget. */
+
+CORE_ARENA_API int arena_create_mapped(size_t n, const char *path, size_t chunk_sz, size_t reserve, int sync);
+/* Creates an arena whose chunks are in the file path, mapped with MAP_SHARED, or opens the
+ * file again, with the objects it had, in a later process. The file may grow to reserve
+ * bytes, which are mapped at once, so the offsets of the objects never change. sync is
+ * ARENA_SYNC_NONE, ARENA_SYNC_ASYNC or ARENA_SYNC_WAIT, for how the chunks the arena moves
+ * on from, and the file at arena_destroy, are written back. Returns 0, or -1 with errno
+ * set. */
+
+CORE_ARENA_API void arena_set_root(size_t n, void *p);
+/* Makes p, an object in a mapped arena, the root a later process gets from arena_root. */
+
+CORE_ARENA_API void *arena_root(size_t n);
+/* Gets the root of a mapped arena, NULL in a new file. */
+
+CORE_ARENA_API void *arena_mapped_base(size_t n);
+/* Gets where the file of a mapped arena is mapped, the offsets from it are stable. */
+
+CORE_ARENA_API int arena_sync(size_t n, int mode);
+/* Records where a mapped arena allocates from in its file, and writes the file back as
+ * mode, an ARENA_SYNC_* constant, says. Returns 0, or -1 with errno set. */
+
+CORE_ARENA_API int arena_snapshot(size_t n, int fd);
+/* Writes an image of what arena n holds in the lifetime in progress to fd, with writev.
+ * The pointers in it must be arena_rel, they hold within a chunk, and between the chunks of
+ * a mapped arena. Its root is the root of a mapped arena, or else the first object
+ * allocated. Returns 0, or -1 with errno set. */
+
+CORE_ARENA_API int arena_load(int fd, struct arena_image *img);
+/* Maps the image in the file fd, from offset 0, read-only, as it is, img gets its root.
+ * Returns 0, or -1 with errno set. */
+
+CORE_ARENA_API void arena_unload(struct arena_image *img);
+/* Unmaps an image mapped by arena_load. */
+
+CORE_ARENA_API int arena_checkpoint(size_t n, const char *dir);
+/* Writes a checkpoint of arena n into the directory dir: the chunks that are dirty since
+ * the last one to dir/chunks.<seq>, and dir/manifest, which arena_checkpoint_restore makes
+ * the image of arena_snapshot from. Returns 0, or -1 with errno set. */
+
+CORE_ARENA_API void arena_mark_dirty(size_t n, const void *p);
+/* Marks the chunk p is in dirty, for objects written in place after a checkpoint. */
+
+CORE_ARENA_API int arena_soft_dirty(size_t n, bool on);
+/* Makes the checkpoints of arena n find the chunks written in place with the soft dirty bits
+ * of /proc/self/pagemap, which are cleared for the whole process at every checkpoint.
+ * Returns 0, or -1 with errno set if the kernel has none. */
+
+CORE_ARENA_API int arena_checkpoint_restore(const char *dir, int fd);
+/* Writes the image of the last checkpoint in dir to fd, for arena_load. Returns 0, or -1
+ * with errno set. */
+
 /** Define the number of arenas you need. */
 
-void *arena_alloc( size_t n, size_t mem_sz );
+CORE_ARENA_API void *arena_alloc( size_t n, size_t mem_sz );
 /* Allocates memory for an object from an arena. */
 
-void *arena_calloc( size_t n,size_t nelem, size_t mem_sz );
+CORE_ARENA_API void *arena_calloc( size_t n,size_t nelem, size_t mem_sz );
 /* Allocates memory for an array,zeroes it out. */
 
-void arena_dealloc(size_t n );
+CORE_ARENA_API void arena_dealloc(size_t n );
 /* Deallocate all objects from a lifetime, when their time is up, but retain the
  * memory for the allocation of a new set of objects in another lifetime. */
 /* TODO: test how this works. */
 
-void arena_destroy( size_t n );
+CORE_ARENA_API size_t arena_trim( size_t n );
+/* Frees the chunks an arena has retained from earlier lifetimes, that the lifetime in
+ * progress hasn't got to, right after arena_dealloc all but the first, and returns the
+ * bytes freed. */
+
+CORE_ARENA_API void arena_destroy( size_t n );
 /* Destroys an arena frees all memory, except for the arrays holding the arenas and
  * arena-logging info. */
+
+CORE_ARENA_API void arena_stats(size_t n, struct arena_stats *out);
+/* Gets the statistics of an arena, counted from arena_create(). */
+
+CORE_ARENA_API void arena_stats_global(struct arena_stats *out);
+/* Gets the statistics summed over all the arenas. */
+
+CORE_ARENA_API int arena_stats_dump(FILE *fp, int format);
+/* Writes the statistics of all the arenas, and the global ones, as ARENA_DUMP_JSON or
+ * ARENA_DUMP_PROMETHEUS. Returns 0, or -1 if the dump couldn't be written. */
+
+CORE_ARENA_API int arena_stats_on_signal(int signo, const char *path, int fd, int format);
+/* Installs a handler that dumps the statistics when signo, e.g. SIGUSR1, arrives, into the
+ * file path, or to fd if path is NULL. The dump is formatted async-signal-safe into a
+ * buffer allocated here. Returns 0, or -1 with errno set. */
+
+CORE_ARENA_API int arena_trace_start(const char *path);
+/* Starts recording every arena_create, arena_alloc, arena_calloc, arena_dealloc and
+ * arena_destroy into the binary trace file path, see bench/replay.c. Returns 0, or -1 with
+ * errno set. */
+
+CORE_ARENA_API void arena_trace_flush(void);
+/* Writes the events recorded by the calling thread. Threads write theirs when they exit,
+ * call it in threads still running when another thread stops the trace. */
+
+CORE_ARENA_API void arena_trace_stop(void);
+/* Stops recording, and closes the trace file. The events other threads have not flushed
+ * are dropped. Installed by atexit() too. */
+
+CORE_ARENA_API void arena_set_max_alloc(size_t bytes);
+/* Sets ARENAS_MAX_ALLOC, the cap on the bytes all the arenas together may have malloc'ed.
+ * By default it is the memory limit of the cgroup of the process, followed when the limit
+ * changes, or, without one, the physical memory that is free at arena_init_arenas. The
+ * environment variable CORE_ARENA_MAX_ALLOC sets it at arena_init_arenas, in bytes, or
+ * with a K, M or G suffix. 0 goes back to the default. */
+
+CORE_ARENA_API size_t arena_get_max_alloc(void);
+/* Gets ARENAS_MAX_ALLOC. */
+
+CORE_ARENA_API void arena_get_chunk_header(size_t *chunk_hdr, size_t *malloc_hdr);
+/* Gets what every chunk costs besides what it hands out: its header, rounded to MAX_ALIGN,
+ * and the bytes malloc keeps in front of it, as found at arena_init_arenas. */
+
+CORE_ARENA_API int arena_pressure_start(const char *path, unsigned stall_us, unsigned window_us);
+/* Starts a thread that waits for memory pressure on the PSI file path, or, if path is NULL,
+ * the memory.pressure of the cgroup v2 of the process, or /proc/pressure/memory. When tasks
+ * have stalled on memory for stall_us within window_us, it frees the chunks the arenas
+ * between arena_dealloc and their next chunk refill retain, but the first, and calls
+ * malloc_trim. The other arenas trim themselves at their next arena_dealloc. Returns 0,
+ * or -1 with errno set. */
+
+CORE_ARENA_API void arena_pressure_stop(void);
+/* Stops the thread of arena_pressure_start. Installed by atexit() too. */
+
+CORE_ARENA_API int arena_set_mmap_threshold(size_t bytes);
+/* Pins malloc's mmap threshold with mallopt(M_MMAP_THRESHOLD), for the whole process, so
+ * glibc doesn't move it when mapped blocks are freed. Chunks at or above it are sized to
+ * whole pages. The environment variable CORE_ARENA_MMAP_THRESHOLD pins it at
+ * arena_init_arenas, in bytes, or with a K or M suffix. Returns 0, or -1 with errno set. */
+
+CORE_ARENA_API void arena_set_log_level(int level);
+/* Sets the logging level at runtime, NO_ARENA_LOGGING, LOG_CHUNK_MALLOCS or
+ * FULL_ARENA_LOGGING. The environment variable CORE_ARENA_LOG_LEVEL sets it at
+ * arena_init_arenas, as a number or as NONE, CHUNKS or EVERYTHING. */
+
+CORE_ARENA_API int arena_get_log_level(void);
+/* Gets the logging level. */
+
+CORE_ARENA_API void report_memory_usage(void);
+/* Reports the memory usage of the arenas to stderr, according to the logging level. It is
+ * installed by atexit() in arena_init_arenas, but can be called at any time. */
+
+CORE_ARENA_API void arena_report_waste(FILE *fp);
+/* Prints the bytes each arena loses to padding, chunk tails and retained one-off oversized
+ * chunks, and their percentage of the bytes malloc has reserved for the arena. */
+
+CORE_ARENA_API void arena_histograms(size_t n, bool on);
+/* Turns collecting of the request size histogram and the lifetime peak sketch of an arena
+ * on or off, after arena_create. They are reported by report_memory_usage too. */
+
+CORE_ARENA_API bool arena_histogram(size_t n, struct arena_histogram *out);
+/* Copies the histograms of an arena, returns false if they aren't collected. */
+
+CORE_ARENA_API size_t arena_hist_peak_quantile(const struct arena_histogram *h, double q);
+/* The lifetime peak at quantile q (0.0 - 1.0), as the lower bound of its bucket. */
 #endif
 
@@ -0,0 +1,271 @@
+/**
+ * @file
+ * @brief Checks of the library: the invariants of the statistics, the round trip of an
+ * arena_snapshot through arena_load, and that the image arena_checkpoint_restore makes of
+ * incremental checkpoints is the image arena_snapshot makes of the arena.
+ * Built and run by `make test`, which fails if a check does.
+ * usage: test_arena
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "core_arena.h"
+
+static int failures;
+
+/** Counts and reports a check that doesn't hold, and goes on with the next. */
+#define CHECK(cond) \
+    do { \
+        if ( !( cond ) ) { \
+            fprintf( stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond ); \
+            failures += 1; \
+        } \
+    } while ( 0 )
+
+/** A node of the lists the images are checked with, linked with self-relative pointers. */
+struct node {
+    arena_rel next;
+    unsigned long v;
+    char pad[24];
+};
+
+/** The temporary directory the files of the checks are made in. */
+static char dir[] = "/tmp/test_arena.XXXXXX";
+
+/**
+ * @brief Appends count nodes, numbered from first, to the list of arena n that ends in
+ * tail, and returns the new tail.
+ */
+static struct node *append( size_t n, struct node *tail, unsigned long first, unsigned long count )
+{
+    for ( unsigned long i = 0; i < count; ++i ) {
+        struct node *p = arena_alloc( n, sizeof *p );
+        if ( !p ) {
+            perror( "arena_alloc" );
+            exit( 1 );
+        }
+        p->v = first + i;
+        if ( tail ) {
+            ARENA_REL_STORE( tail->next, p );
+        }
+        tail = p;
+    }
+    return tail;
+}
+
+/** @brief Sums the values of the list from head, and counts its nodes into *count. */
+static unsigned long sum( const struct node *head, unsigned long *count )
+{
+    unsigned long s = 0;
+    *count = 0;
+    for ( const struct node *p = head; p; p = ARENA_REL_LOAD( const struct node, p->next ) ) {
+        s += p->v;
+        *count += 1;
+    }
+    return s;
+}
+
+/** @brief Opens a new empty file in dir, named name, for an image. */
+static int image_file( const char *name )
+{
+    char path[sizeof dir + 64];
+    snprintf( path, sizeof path, "%s/%s", dir, name );
+    int fd = open( path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+    if ( fd < 0 ) {
+        perror( path );
+        exit( 1 );
+    }
+    return fd;
+}
+
+/** @brief Reads the file fd into a buffer of its size, which is set in *size. */
+static char *slurp( int fd, size_t *size )
+{
+    struct stat st;
+    if ( fstat( fd, &st ) ) {
+        perror( "fstat" );
+        exit( 1 );
+    }
+    char *buf = malloc( ( size_t ) st.st_size + 1 );
+    if ( !buf || pread( fd, buf, ( size_t ) st.st_size, 0 ) != st.st_size ) {
+        perror( "pread" );
+        exit( 1 );
+    }
+    *size = ( size_t ) st.st_size;
+    return buf;
+}
+
+/**
+ * @brief The statistics add up: what is handed out, its padding, the tails and the chunk
+ * headers fit in what malloc reserved, the counts follow the requests, and the global
+ * statistics are the sums of those of the arenas.
+ */
+static void test_stats( void )
+{
+    static const size_t sizes[] = { 1, 7, 16, 24, 33, 100, 1000, 3000 };
+    size_t chunk_hdr, malloc_hdr;
+    arena_get_chunk_header( &chunk_hdr, &malloc_hdr );
+    CHECK( chunk_hdr % MAX_ALIGN == 0 );
+
+    arena_create( 0, 8192 );
+    arena_create( 1, 4096 );
+    unsigned long long want = 0, padded = 0;
+    size_t nreq = 0;
+    for ( int round = 0; round < 50; ++round ) {
+        for ( size_t i = 0; i < sizeof sizes / sizeof *sizes; ++i ) {
+            char *p = arena_alloc( 0, sizes[i] );
+            CHECK( p != NULL && ( ( uintptr_t ) p & ( MAX_ALIGN - 1 ) ) == 0 );
+            want += sizes[i];
+            padded += ( sizes[i] + MAX_ALIGN - 1 ) & ~( size_t ) ( MAX_ALIGN - 1 );
+            nreq += 1;
+        }
+        CHECK( arena_alloc( 1, 40 ) != NULL );
+    }
+
+    struct arena_stats st, st1, g;
+    arena_stats( 0, &st );
+    CHECK( st.requests == nreq );
+    CHECK( st.bytes_allocated == want );
+    CHECK( st.bytes_allocated + st.bytes_padding == padded );
+    CHECK( st.min_request == 1 && st.max_request == 3000 );
+    CHECK( st.bytes_reserved == st.bytes_malloced + st.bytes_mmapped );
+    CHECK( st.bytes_granted == st.bytes_reserved );
+    CHECK( st.mallocs == st.chunks );
+    CHECK( st.chunks == st.refills + 1 );
+    CHECK( st.bytes_allocated + st.bytes_padding + st.bytes_tail + st.chunks * chunk_hdr
+           <= st.bytes_reserved );
+    CHECK( st.max_chunk_size <= st.bytes_reserved );
+    CHECK( st.lifetime_peak >= st.bytes_allocated + st.bytes_padding );
+
+    arena_stats( 1, &st1 );
+    arena_stats_global( &g );
+    CHECK( g.requests == st.requests + st1.requests );
+    CHECK( g.bytes_allocated == st.bytes_allocated + st1.bytes_allocated );
+    CHECK( g.bytes_reserved == st.bytes_reserved + st1.bytes_reserved );
+    CHECK( g.chunks == st.chunks + st1.chunks );
+
+    // A new lifetime starts, the chunks are kept, and the peak with them.
+    arena_dealloc( 0 );
+    struct arena_stats after;
+    arena_stats( 0, &after );
+    CHECK( after.lifetimes == 1 );
+    CHECK( after.bytes_reserved == st.bytes_reserved );
+    CHECK( after.lifetime_peak >= st.bytes_allocated + st.bytes_padding );
+
+    arena_destroy( 0 );
+    arena_destroy( 1 );
+}
+
+/**
+ * @brief An arena_snapshot loads with arena_load as a list that reads as the one written,
+ * with the first object allocated as the root.
+ */
+static void test_snapshot( void )
+{
+    arena_create( 0, 1 << 20 );
+    struct node *head = append( 0, NULL, 0, 1 ), *tail = head;
+    tail = append( 0, tail, 1, 9999 );
+    unsigned long count, want = sum( head, &count );
+    CHECK( count == 10000 );
+
+    int fd = image_file( "snapshot" );
+    CHECK( arena_snapshot( 0, fd ) == 0 );
+    struct arena_image img;
+    CHECK( arena_load( fd, &img ) == 0 );
+    const struct arena_image_header *h = img.base;
+    CHECK( memcmp( h->magic, ARENA_IMAGE_MAGIC, sizeof h->magic ) == 0 );
+    CHECK( h->version == ARENA_IMAGE_VERSION );
+    CHECK( h->size == img.size );
+    CHECK( img.root != NULL && img.root != ( void * ) head );
+    unsigned long loaded_count, loaded = sum( img.root, &loaded_count );
+    CHECK( loaded == want && loaded_count == count );
+    arena_unload( &img );
+    close( fd );
+    arena_destroy( 0 );
+}
+
+/**
+ * @brief Restoring the incremental checkpoints of a mapped arena gives the image that
+ * arena_snapshot gives, after appending, after writing in place, and in a new lifetime.
+ */
+static void test_checkpoint( void )
+{
+    char map[sizeof dir + 16], ckdir[sizeof dir + 16];
+    snprintf( map, sizeof map, "%s/map", dir );
+    snprintf( ckdir, sizeof ckdir, "%s/ck", dir );
+    if ( mkdir( ckdir, 0700 ) ) {
+        perror( ckdir );
+        exit( 1 );
+    }
+    CHECK( arena_create_mapped( 0, map, 64 << 10, 16 << 20, ARENA_SYNC_NONE ) == 0 );
+
+    struct node *head = append( 0, NULL, 0, 1 ), *tail;
+    arena_set_root( 0, head );
+    tail = append( 0, head, 1, 19999 );
+    for ( int step = 0; step < 4; ++step ) {
+        if ( step == 1 ) {
+            tail = append( 0, tail, 20000, 5000 );
+        } else if ( step == 2 ) {
+            head->v = 1000000; // In place, in the first chunk.
+            arena_mark_dirty( 0, head );
+        } else if ( step == 3 ) {
+            arena_dealloc( 0 );
+            head = append( 0, NULL, 0, 1 );
+            arena_set_root( 0, head );
+            append( 0, head, 1, 99 );
+        }
+        CHECK( arena_checkpoint( 0, ckdir ) == 0 );
+
+        int snap = image_file( "snapshot" ), restored = image_file( "restored" );
+        CHECK( arena_snapshot( 0, snap ) == 0 );
+        CHECK( arena_checkpoint_restore( ckdir, restored ) == 0 );
+        size_t snap_sz, restored_sz;
+        char *a = slurp( snap, &snap_sz ), *b = slurp( restored, &restored_sz );
+        CHECK( snap_sz == restored_sz && memcmp( a, b, snap_sz ) == 0 );
+        free( a );
+        free( b );
+
+        struct arena_image img;
+        CHECK( arena_load( restored, &img ) == 0 );
+        unsigned long count, want = sum( head, &count ), loaded_count;
+        CHECK( sum( img.root, &loaded_count ) == want && loaded_count == count );
+        arena_unload( &img );
+        close( snap );
+        close( restored );
+    }
+    arena_destroy( 0 );
+}
+
+/** @brief Removes the files of the checks, and dir. */
+static void cleanup( void )
+{
+    char cmd[sizeof dir + 16];
+    snprintf( cmd, sizeof cmd, "rm -rf %s", dir );
+    if ( system( cmd ) ) {
+        fprintf( stderr, "test_arena: couldn't remove %s\n", dir );
+    }
+}
+
+int main( void )
+{
+    if ( !mkdtemp( dir ) ) {
+        perror( "mkdtemp" );
+        return 1;
+    }
+    arena_init_arenas( 2 );
+    test_stats();
+    test_snapshot();
+    test_checkpoint();
+    cleanup();
+    if ( failures ) {
+        fprintf( stderr, "test_arena: %d checks failed\n", failures );
+        return 1;
+    }
+    printf( "test_arena: all checks passed\n" );
+    return 0;
+}